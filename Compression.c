@@ -0,0 +1,432 @@
+#include "Database.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+Compressed leaf node fields
+*/
+
+bool is_leaf_node_compressed(void *node) {
+  return (*leaf_node_flags(node) & LEAF_NODE_FLAG_COMPRESSED) != 0;
+}
+
+void initialize_compressed_leaf_node(void *node) {
+  initialize_leaf_node(node);
+  *leaf_node_flags(node) = LEAF_NODE_FLAG_COMPRESSED;
+  compressed_leaf_encode(node, NULL, 0);
+}
+
+static uint8_t *compressed_leaf_dict_entry(void *node, uint8_t code) {
+  uint8_t *entry = node + COMPRESSED_LEAF_HEADER_SIZE;
+  for (uint8_t i = 0; i < code; i++) {
+    entry += 1 + entry[0];
+  }
+  return entry;
+}
+
+static uint16_t *compressed_leaf_record_offset(void *node, uint32_t cell_num) {
+  return leaf_node_cell(node, cell_num) + COMPRESSED_LEAF_SLOT_KEY_SIZE;
+}
+
+static uint8_t *compressed_leaf_record(void *node, uint32_t cell_num) {
+  return node + *compressed_leaf_record_offset(node, cell_num);
+}
+
+// First cell at or before cell_num whose username is stored in full
+static uint32_t compressed_leaf_restart(void *node, uint32_t cell_num) {
+  while (compressed_leaf_record(node, cell_num)[0] != 0) {
+    cell_num--;
+  }
+  return cell_num;
+}
+
+// Returns the length of the local part, or the full length if there is no @
+static uint32_t email_local_length(const char *email, uint32_t length) {
+  for (uint32_t i = length; i > 0; i--) {
+    if (email[i - 1] == '@') {
+      return i - 1;
+    }
+  }
+  return length;
+}
+
+typedef struct {
+  const char *domain;
+  uint32_t length;
+  uint32_t count;
+} DomainCandidate;
+
+static int compare_domain_savings(const void *a, const void *b) {
+  const DomainCandidate *x = a;
+  const DomainCandidate *y = b;
+  uint32_t x_saved = x->count * x->length;
+  uint32_t y_saved = y->count * y->length;
+  return (x_saved < y_saved) - (x_saved > y_saved);
+}
+
+/*
+Picks the domains that save the most bytes and appear in at least two rows
+*/
+static uint8_t build_domain_dictionary(Row *rows, uint32_t num_rows,
+                                       DomainCandidate *dictionary) {
+  uint32_t num_candidates = 0;
+  DomainCandidate *candidates =
+      malloc(sizeof(DomainCandidate) * (num_rows ? num_rows : 1));
+  for (uint32_t i = 0; i < num_rows; i++) {
+    uint32_t length = strnlen(rows[i].email, EMAIL_SIZE);
+    uint32_t local_length = email_local_length(rows[i].email, length);
+    if (local_length == length || length - local_length - 1 > UINT8_MAX) {
+      continue;
+    }
+    const char *domain = rows[i].email + local_length + 1;
+    uint32_t domain_length = length - local_length - 1;
+    uint32_t j = 0;
+    while (j < num_candidates &&
+           (candidates[j].length != domain_length ||
+            memcmp(candidates[j].domain, domain, domain_length) != 0)) {
+      j++;
+    }
+    if (j == num_candidates) {
+      candidates[num_candidates++] =
+          (DomainCandidate){domain, domain_length, 0};
+    }
+    candidates[j].count++;
+  }
+  qsort(candidates, num_candidates, sizeof(DomainCandidate),
+        compare_domain_savings);
+  uint8_t dict_count = 0;
+  for (uint32_t i = 0; i < num_candidates &&
+                       dict_count < COMPRESSED_LEAF_MAX_DOMAINS;
+       i++) {
+    if (candidates[i].count >= 2) {
+      dictionary[dict_count++] = candidates[i];
+    }
+  }
+  free(candidates);
+  return dict_count;
+}
+
+static void compressed_leaf_write_record(uint8_t *record, const char *username,
+                                         uint32_t prefix, uint32_t suffix,
+                                         uint8_t code, const char *email,
+                                         uint32_t part_length) {
+  record[0] = (uint8_t)prefix;
+  record[1] = (uint8_t)suffix;
+  memcpy(record + 2, username + prefix, suffix);
+  record[2 + suffix] = code;
+  record[3 + suffix] = (uint8_t)part_length;
+  memcpy(record + 4 + suffix, email, part_length);
+}
+
+/*
+Re-encodes the node from scratch with the given rows, keeping the leaf
+header (type, root, parent and next leaf). Leaves the node untouched and
+returns false if the rows do not fit in one page.
+*/
+bool compressed_leaf_encode(void *node, Row *rows, uint32_t num_rows) {
+  DomainCandidate dictionary[COMPRESSED_LEAF_MAX_DOMAINS];
+  uint8_t dict_count = build_domain_dictionary(rows, num_rows, dictionary);
+
+  uint8_t *page = calloc(1, PAGE_SIZE);
+  memcpy(page, node, LEAF_NODE_HEADER_SIZE);
+  *leaf_node_flags(page) |= LEAF_NODE_FLAG_COMPRESSED;
+  *leaf_node_num_cells(page) = num_rows;
+  *(page + COMPRESSED_LEAF_DICT_COUNT_OFFSET) = dict_count;
+
+  uint32_t pos = COMPRESSED_LEAF_HEADER_SIZE;
+  for (uint8_t code = 0; code < dict_count; code++) {
+    page[pos] = (uint8_t)dictionary[code].length;
+    memcpy(page + pos + 1, dictionary[code].domain, dictionary[code].length);
+    pos += 1 + dictionary[code].length;
+  }
+  *(uint16_t *)(page + COMPRESSED_LEAF_SLOTS_OFFSET_OFFSET) = (uint16_t)pos;
+  uint32_t slots_end = pos + num_rows * COMPRESSED_LEAF_SLOT_SIZE;
+  if (slots_end > PAGE_SIZE) {
+    free(page);
+    return false;
+  }
+  // Records fill the page from the end, leaving the gap for inserts
+  pos = PAGE_SIZE;
+
+  const char *previous = "";
+  uint32_t previous_length = 0;
+  for (uint32_t i = 0; i < num_rows; i++) {
+    const char *username = rows[i].username;
+    uint32_t username_length = strnlen(username, USERNAME_SIZE);
+    uint32_t prefix = 0;
+    if (i % COMPRESSED_LEAF_RESTART_INTERVAL != 0) {
+      while (prefix < username_length && prefix < previous_length &&
+             username[prefix] == previous[prefix]) {
+        prefix++;
+      }
+    }
+    uint32_t suffix = username_length - prefix;
+
+    const char *email = rows[i].email;
+    uint32_t email_length = strnlen(email, EMAIL_SIZE);
+    uint32_t local_length = email_local_length(email, email_length);
+    uint8_t code = COMPRESSED_LEAF_NO_DOMAIN;
+    for (uint8_t j = 0; j < dict_count && local_length < email_length; j++) {
+      if (dictionary[j].length == email_length - local_length - 1 &&
+          memcmp(dictionary[j].domain, email + local_length + 1,
+                 dictionary[j].length) == 0) {
+        code = j;
+        break;
+      }
+    }
+    uint32_t part_length =
+        code == COMPRESSED_LEAF_NO_DOMAIN ? email_length : local_length;
+
+    uint32_t record_size = 2 + suffix + 2 + part_length;
+    if (pos - slots_end < record_size) {
+      free(page);
+      return false;
+    }
+    pos -= record_size;
+    void *slot = leaf_node_cell(page, i);
+    key_encode(slot, rows[i].id);
+    *(uint16_t *)(slot + COMPRESSED_LEAF_SLOT_KEY_SIZE) = (uint16_t)pos;
+    compressed_leaf_write_record(page + pos, username, prefix, suffix, code,
+                                 email, part_length);
+
+    previous = username;
+    previous_length = username_length;
+  }
+
+  memcpy(node, page, PAGE_SIZE);
+  free(page);
+  return true;
+}
+
+void compressed_leaf_decode_row(void *node, uint32_t cell_num, Row *row) {
+  memset(row, 0, sizeof(Row));
+  row->id = leaf_node_key(node, cell_num);
+
+  // Usernames are rebuilt forward from the last restart point
+  uint8_t *record = NULL;
+  for (uint32_t i = compressed_leaf_restart(node, cell_num); i <= cell_num;
+       i++) {
+    record = compressed_leaf_record(node, i);
+    memcpy(row->username + record[0], record + 2, record[1]);
+    row->username[record[0] + record[1]] = '\0';
+  }
+
+  uint8_t *email = record + 2 + record[1];
+  uint8_t code = email[0];
+  uint8_t part_length = email[1];
+  memcpy(row->email, email + 2, part_length);
+  if (code != COMPRESSED_LEAF_NO_DOMAIN) {
+    uint8_t *domain = compressed_leaf_dict_entry(node, code);
+    uint32_t domain_length = domain[0];
+    if (part_length + 1 + domain_length > EMAIL_SIZE) {
+      domain_length = EMAIL_SIZE - part_length - 1;
+    }
+    row->email[part_length] = '@';
+    memcpy(row->email + part_length + 1, domain + 1, domain_length);
+  }
+}
+
+static Row *compressed_leaf_decode_all(void *node, uint32_t extra_rows) {
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  Row *rows = malloc(sizeof(Row) * (num_cells + extra_rows));
+  for (uint32_t i = 0; i < num_cells; i++) {
+    compressed_leaf_decode_row(node, i, &rows[i]);
+  }
+  return rows;
+}
+
+static uint32_t common_prefix_length(const char *a, const char *b) {
+  uint32_t length = 0;
+  while (length < USERNAME_SIZE && a[length] != '\0' &&
+         a[length] == b[length]) {
+    length++;
+  }
+  return length;
+}
+
+/*
+Tries to add the row without touching the other records: the new record
+goes into the gap between the slots and the records, and the slots after
+it move up by one. The new row shares its predecessor's username prefix
+when that keeps it within COMPRESSED_LEAF_RESTART_INTERVAL of a restart
+and the next cell is a restart, otherwise it becomes a restart itself and
+the next cell's record is rewritten against it. A domain missing from the
+dictionary is stored in full until the page is next rebuilt. Returns false
+if there is not enough free space, leaving the node untouched.
+*/
+static bool compressed_leaf_insert_in_place(void *node, uint32_t cell_num,
+                                            uint64_t key, Row *value) {
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  uint16_t slots_offset =
+      *(uint16_t *)(node + COMPRESSED_LEAF_SLOTS_OFFSET_OFFSET);
+  uint32_t slots_end =
+      slots_offset + (num_cells + 1) * COMPRESSED_LEAF_SLOT_SIZE;
+  uint32_t records_start = PAGE_SIZE;
+  for (uint32_t i = 0; i < num_cells; i++) {
+    uint16_t offset = *compressed_leaf_record_offset(node, i);
+    if (offset < records_start) {
+      records_start = offset;
+    }
+  }
+
+  uint32_t username_length = strnlen(value->username, USERNAME_SIZE);
+  uint32_t prefix = 0;
+  bool next_is_restart =
+      cell_num == num_cells || compressed_leaf_record(node, cell_num)[0] == 0;
+  if (cell_num > 0 && next_is_restart &&
+      cell_num - compressed_leaf_restart(node, cell_num - 1) <
+          COMPRESSED_LEAF_RESTART_INTERVAL) {
+    Row previous;
+    compressed_leaf_decode_row(node, cell_num - 1, &previous);
+    prefix = common_prefix_length(value->username, previous.username);
+  }
+  uint32_t suffix = username_length - prefix;
+
+  uint32_t email_length = strnlen(value->email, EMAIL_SIZE);
+  uint32_t local_length = email_local_length(value->email, email_length);
+  uint8_t code = COMPRESSED_LEAF_NO_DOMAIN;
+  if (local_length < email_length) {
+    code = compressed_leaf_domain_code(node, value->email + local_length + 1,
+                                       email_length - local_length - 1);
+  }
+  uint32_t part_length =
+      code == COMPRESSED_LEAF_NO_DOMAIN ? email_length : local_length;
+  uint32_t record_size = 2 + suffix + 2 + part_length;
+
+  // The next cell's username is rebuilt from the new row instead
+  Row next;
+  uint32_t next_prefix = 0;
+  uint32_t next_suffix = 0;
+  uint8_t *next_email = NULL;
+  uint32_t next_record_size = 0;
+  if (!next_is_restart) {
+    compressed_leaf_decode_row(node, cell_num, &next);
+    next_prefix = common_prefix_length(next.username, value->username);
+    next_suffix = strnlen(next.username, USERNAME_SIZE) - next_prefix;
+    uint8_t *record = compressed_leaf_record(node, cell_num);
+    next_email = record + 2 + record[1];
+    next_record_size = 2 + next_suffix + 2 + next_email[1];
+  }
+
+  if (slots_end > records_start ||
+      records_start - slots_end < record_size + next_record_size) {
+    return false;
+  }
+
+  uint32_t pos = records_start - record_size;
+  compressed_leaf_write_record(node + pos, value->username, prefix, suffix,
+                               code, value->email, part_length);
+  if (!next_is_restart) {
+    uint32_t next_pos = pos - next_record_size;
+    compressed_leaf_write_record(node + next_pos, next.username, next_prefix,
+                                 next_suffix, next_email[0],
+                                 (char *)next_email + 2, next_email[1]);
+    *compressed_leaf_record_offset(node, cell_num) = (uint16_t)next_pos;
+  }
+
+  memmove(leaf_node_cell(node, cell_num + 1), leaf_node_cell(node, cell_num),
+          (num_cells - cell_num) * COMPRESSED_LEAF_SLOT_SIZE);
+  (*leaf_node_num_cells(node))++;
+  set_leaf_node_key(node, cell_num, key);
+  *compressed_leaf_record_offset(node, cell_num) = (uint16_t)pos;
+  return true;
+}
+
+void compressed_leaf_insert(Cursor *cursor, uint64_t key, Row *value) {
+  void *node = get_page_for_write(cursor->table->pager, cursor->page_num);
+  if (compressed_leaf_insert_in_place(node, cursor->cell_num, key, value)) {
+    return;
+  }
+
+  // Out of room: rebuild the page, reclaiming dead records, or split it
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  Row *rows = compressed_leaf_decode_all(node, 1);
+  memmove(&rows[cursor->cell_num + 1], &rows[cursor->cell_num],
+          sizeof(Row) * (num_cells - cursor->cell_num));
+  rows[cursor->cell_num] = *value;
+  rows[cursor->cell_num].id = key;
+  compressed_leaf_store(cursor->table, cursor->page_num, rows, num_cells + 1);
+  free(rows);
+}
+
+void compressed_leaf_update(Cursor *cursor, Row *value, uint32_t columns) {
+  void *node = get_page_for_write(cursor->table->pager, cursor->page_num);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  Row *rows = compressed_leaf_decode_all(node, 0);
+  Row *row = &rows[cursor->cell_num];
+  if (columns & UPDATE_USERNAME) {
+    memcpy(row->username, value->username, sizeof(row->username));
+  }
+  if (columns & UPDATE_EMAIL) {
+    memcpy(row->email, value->email, sizeof(row->email));
+  }
+  compressed_leaf_store(cursor->table, cursor->page_num, rows, num_cells);
+  free(rows);
+}
+
+/*
+Writes the rows into the page, splitting it in two if they do not fit
+*/
+void compressed_leaf_store(Table *table, uint32_t page_num, Row *rows,
+                           uint32_t num_rows) {
+  void *old_node = get_page_for_write(table->pager, page_num);
+  uint64_t old_max =
+      *leaf_node_num_cells(old_node) ? get_node_max_key(old_node) : 0;
+  if (compressed_leaf_encode(old_node, rows, num_rows)) {
+    return;
+  }
+
+  uint32_t new_page_num = get_unused_page_num(table->pager);
+  void *new_node = get_page_for_write(table->pager, new_page_num);
+  initialize_compressed_leaf_node(new_node);
+  *node_parent(new_node) = *node_parent(old_node);
+  *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
+  *leaf_node_next_leaf(old_node) = new_page_num;
+
+  // Split as close to the middle as both halves allow
+  uint32_t middle = num_rows / 2;
+  bool split = false;
+  for (uint32_t distance = 0; distance <= middle && !split; distance++) {
+    uint32_t candidates[2] = {middle - distance, middle + distance};
+    for (int i = 0; i < 2 && !split; i++) {
+      uint32_t left_count = candidates[i];
+      if (left_count == 0 || left_count >= num_rows) {
+        continue;
+      }
+      split = compressed_leaf_encode(old_node, rows, left_count) &&
+              compressed_leaf_encode(new_node, rows + left_count,
+                                     num_rows - left_count);
+    }
+  }
+  if (!split) {
+    printf("Rows do not fit in two compressed leaves\n");
+    exit(EXIT_FAILURE);
+  }
+
+  leaf_node_split_update_parent(table, old_node, old_max, new_page_num);
+}
+
+/*
+Filters on the email domain can compare dictionary codes instead of
+decompressing every row
+*/
+uint8_t compressed_leaf_domain_code(void *node, const char *domain,
+                                    uint32_t length) {
+  uint8_t dict_count = *(uint8_t *)(node + COMPRESSED_LEAF_DICT_COUNT_OFFSET);
+  uint8_t *entry = node + COMPRESSED_LEAF_HEADER_SIZE;
+  for (uint8_t code = 0; code < dict_count; code++) {
+    if (entry[0] == length && memcmp(entry + 1, domain, length) == 0) {
+      return code;
+    }
+    entry += 1 + entry[0];
+  }
+  return COMPRESSED_LEAF_NO_DOMAIN;
+}
+
+uint8_t compressed_leaf_row_domain_code(void *node, uint32_t cell_num) {
+  uint8_t *record = compressed_leaf_record(node, cell_num);
+  return record[2 + record[1]];
+}
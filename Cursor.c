@@ -10,16 +10,34 @@
 #include <unistd.h>
 
 Cursor *table_start(Table *table) {
-  Cursor *cursor = table_find(table, 0);
+  Cursor *cursor = table_seek(table, 0);
+  // Scans pin the tree as it is now, later writes copy pages on write
+  cursor->snapshot = pager_snapshot_begin(table->pager);
   void *node = get_page(table->pager, cursor->page_num);
   uint32_t num_cells = *leaf_node_num_cells(node);
   cursor->end_of_table = (num_cells == 0);
   return cursor;
 }
 
+void *cursor_page(Cursor *cursor, uint32_t page_num) {
+  Pager *pager = cursor->table->pager;
+  if (cursor->snapshot == NULL) {
+    return get_page(pager, page_num);
+  }
+  return get_page_version(pager, page_num, cursor->snapshot->epoch);
+}
+
+void cursor_close(Cursor *cursor) {
+  if (cursor->snapshot != NULL) {
+    pager_snapshot_end(cursor->table->pager, cursor->snapshot);
+  }
+  free(cursor->value_buffer);
+  free(cursor);
+}
+
 void cursor_advance(Cursor *cursor) {
   uint32_t page_num = cursor->page_num;
-  void *node = get_page(cursor->table->pager, page_num);
+  void *node = cursor_page(cursor, page_num);
   cursor->cell_num++;
   if (cursor->cell_num >= (*leaf_node_num_cells(node))) {
     uint32_t next_page_num = *leaf_node_next_leaf(node);
@@ -32,19 +50,35 @@ void cursor_advance(Cursor *cursor) {
   }
 }
 
-Cursor *table_find(Table *table, uint32_t key) {
+/*
+Point lookup: tries the adaptive hash index first and feeds it after a
+full descent
+*/
+Cursor *table_find(Table *table, uint64_t key) {
+  Cursor *cursor = adaptive_hash_lookup(table, key);
+  if (cursor != NULL) {
+    return cursor;
+  }
+  cursor = table_seek(table, key);
+  adaptive_hash_record(table, key, cursor);
+  return cursor;
+}
+
+/*
+Descends to the position of key without touching the adaptive hash index,
+for scans that only need a starting point
+*/
+Cursor *table_seek(Table *table, uint64_t key) {
   uint32_t root_page_num = table->root_page_num;
   void *root_node = get_page(table->pager, root_page_num);
 
   if (get_node_type(root_node) == NODE_LEAF) {
     return leaf_node_find(table, root_page_num, key);
-  } else {
-    return internal_node_find(table, root_page_num, key);
-    exit(EXIT_FAILURE);
   }
+  return internal_node_find(table, root_page_num, key);
 }
 
-Cursor *leaf_node_find(Table *table, uint32_t page_num, uint32_t key) {
+Cursor *leaf_node_find(Table *table, uint32_t page_num, uint64_t key) {
 
   Cursor *cursor = calloc(1, sizeof(Cursor));
   cursor->table = table;
@@ -57,11 +91,11 @@ Cursor *leaf_node_find(Table *table, uint32_t page_num, uint32_t key) {
   uint32_t max_val = num_cells;
   while (max_val != min_val) {
     uint32_t index = (min_val + max_val) / 2;
-    uint32_t key_at_index = *leaf_node_key(node, index);
+    uint64_t key_at_index = leaf_node_key(node, index);
     if (key == key_at_index) {
       cursor->cell_num = index;
       return cursor;
-    } else if (key > key_at_index) {
+    } else if (key < key_at_index) {
       max_val = index;
     } else {
       min_val = index + 1;
@@ -71,7 +105,7 @@ Cursor *leaf_node_find(Table *table, uint32_t page_num, uint32_t key) {
   return cursor;
 }
 
-Cursor *internal_node_find(Table *table, uint32_t page_num, uint32_t key) {
+Cursor *internal_node_find(Table *table, uint32_t page_num, uint64_t key) {
   void *node = get_page(table->pager, page_num);
   uint32_t num_keys = *internal_node_num_keys(node);
 
@@ -86,14 +120,14 @@ Cursor *internal_node_find(Table *table, uint32_t page_num, uint32_t key) {
   }
 }
 
-uint32_t internal_node_find_child(void *node, uint32_t key) {
+uint32_t internal_node_find_child(void *node, uint64_t key) {
   uint32_t num_keys = *internal_node_num_keys(node);
 
   uint32_t min_val = 0;
   uint32_t max_val = num_keys;
   while (max_val != min_val) {
     uint32_t index = (min_val + max_val) / 2;
-    uint32_t key_at_index = *internal_node_key(node, index);
+    uint64_t key_at_index = internal_node_key(node, index);
     if (key <= key_at_index) {
       max_val = index;
     } else {
@@ -101,4 +135,169 @@ uint32_t internal_node_find_child(void *node, uint32_t key) {
     }
   }
   return min_val;
-}
\ No newline at end of file
+}
+
+static void leaf_node_read_row(void *node, uint32_t cell_num, Row *row) {
+  if (is_leaf_node_compressed(node)) {
+    compressed_leaf_decode_row(node, cell_num, row);
+  } else {
+    deserialize_row(leaf_node_value(node, cell_num), row);
+  }
+}
+
+/*
+Seeks to the first key >= low and follows the leaf chain until a key passes
+high, so a key range (e.g. one tenant) costs a single descent. If the
+callback split a leaf (a compressed leaf grew on update) the walk seeks the
+next key again instead of trusting the cursor.
+*/
+void table_walk_range(Table *table, uint64_t low, uint64_t high,
+                      CellCallback callback, void *context) {
+  Pager *pager = table->pager;
+  Cursor *cursor = table_find(table, low);
+  while (true) {
+    void *node = get_page(pager, cursor->page_num);
+    if (cursor->cell_num >= *leaf_node_num_cells(node)) {
+      uint32_t next_page_num = *leaf_node_next_leaf(node);
+      if (next_page_num == 0) {
+        break;
+      }
+      cursor->page_num = next_page_num;
+      cursor->cell_num = 0;
+      continue;
+    }
+    uint64_t key = leaf_node_key(node, cursor->cell_num);
+    if (key > high) {
+      break;
+    }
+    uint32_t num_pages = pager->num_of_pages;
+    if (!callback(cursor, context) || key == high || key == max_key()) {
+      break;
+    }
+    if (pager->num_of_pages != num_pages) {
+      cursor_close(cursor);
+      cursor = table_seek(table, key + 1);
+    } else {
+      cursor->cell_num++;
+    }
+  }
+  cursor_close(cursor);
+}
+
+typedef struct {
+  RowCallback callback;
+  void *context;
+} RangeScan;
+
+static bool range_scan_cell(Cursor *cursor, void *context) {
+  RangeScan *scan = (RangeScan *)context;
+  Row row;
+  leaf_node_read_row(get_page(cursor->table->pager, cursor->page_num),
+                     cursor->cell_num, &row);
+  return scan->callback(&row, scan->context);
+}
+
+void table_range_scan(Table *table, uint64_t low, uint64_t high,
+                      RowCallback callback, void *context) {
+  RangeScan scan = {callback, context};
+  table_walk_range(table, low, high, range_scan_cell, &scan);
+}
+
+typedef struct {
+  uint32_t page_num;
+  uint32_t first_key; // index of the group's first key in the batch
+  uint32_t num_keys;
+} MultiFindGroup;
+
+static int compare_keys(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+/*
+Looks up a batch of keys, sorted and deduplicated in place, and hands the
+rows that exist to the callback in key order. Instead of one descent per
+key the batch goes down the tree a level at a time: the keys of a node are
+split among its children so a shared path is read once, and every page of
+the next level is prefetched before the first of them is searched.
+*/
+void table_multi_find(Table *table, uint64_t *keys, uint32_t num_keys,
+                      RowCallback callback, void *context) {
+  if (num_keys == 0) {
+    return;
+  }
+  qsort(keys, num_keys, sizeof(uint64_t), compare_keys);
+  uint32_t num_unique = 1;
+  for (uint32_t i = 1; i < num_keys; i++) {
+    if (keys[i] != keys[num_unique - 1]) {
+      keys[num_unique++] = keys[i];
+    }
+  }
+  num_keys = num_unique;
+
+  Pager *pager = table->pager;
+  MultiFindGroup *level = malloc(num_keys * sizeof(MultiFindGroup));
+  MultiFindGroup *next_level = malloc(num_keys * sizeof(MultiFindGroup));
+  level[0] = (MultiFindGroup){table->root_page_num, 0, num_keys};
+  uint32_t num_groups = 1;
+
+  bool descended = true;
+  while (descended) {
+    descended = false;
+    uint32_t num_next = 0;
+    for (uint32_t g = 0; g < num_groups; g++) {
+      MultiFindGroup *group = &(level[g]);
+      void *node = get_page(pager, group->page_num);
+      if (get_node_type(node) == NODE_LEAF) {
+        next_level[num_next++] = *group;
+        continue;
+      }
+      descended = true;
+      uint32_t last_key = group->first_key + group->num_keys;
+      for (uint32_t i = group->first_key; i < last_key; i++) {
+        uint32_t child_page_num =
+            *internal_node_child(node, internal_node_find_child(node, keys[i]));
+        if (num_next > 0 &&
+            next_level[num_next - 1].page_num == child_page_num) {
+          next_level[num_next - 1].num_keys++;
+        } else {
+          next_level[num_next++] = (MultiFindGroup){child_page_num, i, 1};
+          pager_prefetch(pager, child_page_num);
+        }
+      }
+    }
+    MultiFindGroup *temp = level;
+    level = next_level;
+    next_level = temp;
+    num_groups = num_next;
+  }
+
+  Row row;
+  bool more = true;
+  for (uint32_t g = 0; more && g < num_groups; g++) {
+    void *node = get_page(pager, level[g].page_num);
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    uint32_t cell_num = 0;
+    uint32_t last_key = level[g].first_key + level[g].num_keys;
+    for (uint32_t i = level[g].first_key; more && i < last_key; i++) {
+      // Keys ascend, so each search starts where the previous one ended
+      uint32_t max_val = num_cells;
+      while (cell_num != max_val) {
+        uint32_t index = (cell_num + max_val) / 2;
+        if (leaf_node_key(node, index) < keys[i]) {
+          cell_num = index + 1;
+        } else {
+          max_val = index;
+        }
+      }
+      if (cell_num == num_cells || leaf_node_key(node, cell_num) != keys[i]) {
+        continue;
+      }
+      leaf_node_read_row(node, cell_num, &row);
+      more = callback(&row, context);
+    }
+  }
+  free(level);
+  free(next_level);
+}
@@ -1,23 +1,27 @@
+#define _GNU_SOURCE
 #include "Database.h"
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
-const uint32_t ID_SIZE = sizeof(uint32_t);
+const uint32_t ID_SIZE = sizeof(uint64_t);
 const uint32_t ID_OFFSET = 0;
 const uint32_t USERNAME_SIZE = 32;
 const uint32_t USERNAME_OFFSET = ID_OFFSET + ID_SIZE;
 const uint32_t EMAIL_SIZE = 255;
 const uint32_t EMAIL_OFFSET = USERNAME_OFFSET + USERNAME_SIZE;
-const uint32_t PAGE_SIZE = 4096;
 const uint32_t ROW_SIZE = ID_SIZE + USERNAME_SIZE + EMAIL_SIZE;
-const uint32_t ROWS_PER_PAGE = PAGE_SIZE / ROW_SIZE;
+uint32_t PAGE_SIZE = DEFAULT_PAGE_SIZE;
+uint32_t KEY_SIZE = DEFAULT_KEY_SIZE;
+bool COMPOSITE_KEYS = false;
 
 void print_prompt() { printf("db > "); }
 
@@ -34,13 +38,20 @@ void deserialize_row(void *source, Row *destination) {
 }
 
 void *cursor_value(Cursor *cursor) {
-  Table *table = cursor->table;
-  uint32_t page_num = cursor->page_num;
-  void *node = get_page(table->pager, page_num);
+  void *node = cursor_page(cursor, cursor->page_num);
+  if (is_leaf_node_compressed(node)) {
+    Row row;
+    compressed_leaf_decode_row(node, cursor->cell_num, &row);
+    if (cursor->value_buffer == NULL) {
+      cursor->value_buffer = malloc(ROW_SIZE);
+    }
+    serialize_row(&row, cursor->value_buffer);
+    return cursor->value_buffer;
+  }
   return leaf_node_value(node, cursor->cell_num);
 }
 
-void pager_flush(Pager *pager, uint32_t page_num, uint32_t size) {
+void pager_write_page(Pager *pager, uint32_t page_num, uint32_t size) {
   off_t offset = lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
   int status = pwrite(pager->file_descriptor, pager->pages[page_num],
                       (size_t)size, offset);
@@ -48,48 +59,521 @@ void pager_flush(Pager *pager, uint32_t page_num, uint32_t size) {
     printf("Error while flushing pages\n");
   if (status == 0)
     printf("Reached the end of file\n");
-  free(pager->pages[page_num]);
+  if (status == (int)size) {
+    pager_note_written(pager, page_num);
+  }
+  pager->dirty[page_num] = false;
+}
+
+void pager_note_written(Pager *pager, uint32_t page_num) {
+  if ((page_num + 1) * PAGE_SIZE > pager->file_length) {
+    pager->file_length = (page_num + 1) * PAGE_SIZE;
+  }
+}
+
+void pager_flush(Pager *pager, uint32_t page_num, uint32_t size) {
+  pager_write_page(pager, page_num, size);
   pager->pages[page_num] = NULL;
 }
 
 uint32_t get_unused_page_num(Pager *pager) { return pager->num_of_pages; }
 
+bool is_valid_page_size(uint32_t page_size) {
+  return page_size >= MIN_PAGE_SIZE && page_size <= MAX_PAGE_SIZE &&
+         (page_size & (page_size - 1)) == 0;
+}
+
+void pager_write_header(Pager *pager) {
+  // The header page never has a cached node, so its frame is free to use
+  void *page = pager->arena + DB_HEADER_PAGE_NUM * PAGE_SIZE;
+  memset(page, 0, PAGE_SIZE);
+  memcpy(page, &(pager->header), sizeof(DbHeader));
+  ssize_t status = pwrite(pager->file_descriptor, page, PAGE_SIZE,
+                          DB_HEADER_PAGE_NUM * PAGE_SIZE);
+  if (status == -1)
+    printf("Error while writing db header\n");
+}
+
+void pager_allocate_arena(Pager *pager) {
+  size_t arena_size = (size_t)TABLE_MAX_PAGES * PAGE_SIZE;
+  size_t alignment = PAGE_FRAME_ALIGNMENT;
+  if (arena_size >= HUGE_PAGE_SIZE) {
+    // Only whole, aligned huge pages can back the arena
+    alignment = HUGE_PAGE_SIZE;
+    arena_size = (arena_size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE *
+                 HUGE_PAGE_SIZE;
+  }
+  if (posix_memalign(&(pager->arena), alignment, arena_size)) {
+    printf("Unable to allocate page arena\n");
+    exit(EXIT_FAILURE);
+  }
+#ifdef MADV_HUGEPAGE
+  if (alignment == HUGE_PAGE_SIZE) {
+    madvise(pager->arena, arena_size, MADV_HUGEPAGE);
+  }
+#endif
+}
+
+void pager_enable_direct_io(Pager *pager) {
+#ifdef O_DIRECT
+  int fd = pager->file_descriptor;
+  if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_DIRECT) == 0) {
+    pager->direct_io = true;
+    return;
+  }
+#endif
+  printf("O_DIRECT is not supported here, using buffered I/O\n");
+}
+
 void db_close(Table *table) {
   Pager *pager = table->pager;
+  pager_stop_flusher(pager);
+  while (pager->snapshots) {
+    pager_snapshot_end(pager, pager->snapshots);
+  }
   for (uint32_t i = 0; i < pager->num_of_pages; i++) {
     if (pager->pages[i] == NULL) {
       continue;
     }
+    if (!pager->dirty[i]) {
+      pager->pages[i] = NULL;
+      continue;
+    }
     pager_flush(pager, i, PAGE_SIZE);
-    free(pager->pages[i]);
-    pager->pages[i] = NULL;
   }
+  pager->header.root_page_num = table->root_page_num;
+  pager->header.num_pages = pager->num_of_pages;
+  pager_write_header(pager);
+  pager_free(pager);
+  adaptive_hash_free(table->hash_index);
+  free(table);
+}
 
+/*
+Closes the file and frees the pager without writing anything back
+*/
+void pager_free(Pager *pager) {
   int res = close(pager->file_descriptor);
   if (res == -1) {
     printf("Error closing db file\n");
     exit(EXIT_FAILURE);
   }
   for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-    if (pager->pages[i]) {
-      free(pager->pages[i]);
-      pager->pages[i] = NULL;
+    while (pager->versions[i] != NULL) {
+      PageVersion *version = pager->versions[i];
+      pager->versions[i] = version->next;
+      free(version->image);
+      free(version);
     }
   }
+  free(pager->arena);
+  free(pager->flush_buffer);
+  free(pager->filename);
+  pthread_mutex_destroy(&(pager->latch));
+  pthread_cond_destroy(&(pager->flusher_wakeup));
   free(pager);
-  free(table);
+}
+
+/*
+Writes every dirty page and the header without dropping anything from the
+cache. With the background writer running only a small residue is left.
+*/
+uint32_t db_checkpoint(Table *table) {
+  Pager *pager = table->pager;
+  uint32_t num_written = 0;
+  pager_lock(pager);
+  for (uint32_t i = 0; i < pager->num_of_pages; i++) {
+    if (pager->pages[i] != NULL && pager->dirty[i]) {
+      pager_write_page(pager, i, PAGE_SIZE);
+      num_written++;
+    }
+  }
+  pager->header.root_page_num = table->root_page_num;
+  pager->header.num_pages = pager->num_of_pages;
+  pager_write_header(pager);
+  fsync(pager->file_descriptor);
+  pager_unlock(pager);
+  return num_written;
 }
 
 MetaCommandResult do_meta_command(InputBuffer *input_buffer, Table *table) {
   if (!strcmp((input_buffer->buffer), ".exit")) {
     close_input_buffer(&input_buffer);
     db_close(table);
+    return META_COMMAND_EXIT;
+  } else if (!strcmp((input_buffer->buffer), ".checkpoint")) {
+    uint32_t num_written = db_checkpoint(table);
+    printf("Checkpoint wrote %d pages, %" PRIu64
+           " were written in background.\n",
+           num_written, table->pager->pages_flushed_in_background);
+    return META_COMMAND_SUCCESS;
+  } else if (!strncmp(input_buffer->buffer, ".vacuum", 7) &&
+             (input_buffer->buffer[7] == '\0' ||
+              input_buffer->buffer[7] == ' ')) {
+    uint32_t fill_percent = VACUUM_DEFAULT_FILL_PERCENT;
+    if (input_buffer->buffer[7] == ' ') {
+      fill_percent = (uint32_t)strtoul(input_buffer->buffer + 8, NULL, 10);
+    }
+    if (fill_percent < VACUUM_MIN_FILL_PERCENT || fill_percent > 100) {
+      printf("Fill factor must be between %d and 100 percent.\n",
+             VACUUM_MIN_FILL_PERCENT);
+      return META_COMMAND_SUCCESS;
+    }
+    db_vacuum(table, fill_percent);
+    return META_COMMAND_SUCCESS;
+  } else if (!strcmp((input_buffer->buffer), ".hash")) {
+    adaptive_hash_print_stats(table->hash_index);
     return META_COMMAND_SUCCESS;
   } else {
     return META_COMMAND_UNRECOGNIZED_COMMAND;
   }
 }
 
+PrepareResult parse_id(char *token, uint32_t *id) {
+  if (token == NULL) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  char *ptr;
+  long num = strtol(token, &ptr, 10);
+  if (ptr == token || *ptr != '\0') {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  if (num < 0) {
+    return PREPARE_NEGATIVE_ID;
+  }
+  *id = (uint32_t)num;
+  return PREPARE_SUCCESS;
+}
+
+/*
+Parses the unsigned number at the start of token, end is left on the first
+character after it
+*/
+static PrepareResult parse_key_part(char *token, char **end,
+                                    uint64_t *part) {
+  if (token[0] == '-') {
+    return PREPARE_NEGATIVE_ID;
+  }
+  errno = 0;
+  unsigned long long num = strtoull(token, end, 10);
+  if (*end == token) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  if (errno == ERANGE) {
+    return COMPOSITE_KEYS ? PREPARE_KEY_PART_TOO_LARGE : PREPARE_KEY_TOO_LARGE;
+  }
+  *part = num;
+  return PREPARE_SUCCESS;
+}
+
+/*
+Parses "<id>", or "<tenant>:<user>" on tables with composite keys, where a
+bare id is rejected
+*/
+PrepareResult parse_key(char *token, uint64_t *key) {
+  if (token == NULL) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  char *ptr;
+  uint64_t num;
+  PrepareResult result = parse_key_part(token, &ptr, &num);
+  if (result != PREPARE_SUCCESS) {
+    return result;
+  }
+  if (COMPOSITE_KEYS) {
+    if (*ptr != ':') {
+      return *ptr == '\0' ? PREPARE_COMPOSITE_KEY_EXPECTED
+                          : PREPARE_SYNTAX_ERROR;
+    }
+    uint64_t user_id;
+    result = parse_key_part(ptr + 1, &ptr, &user_id);
+    if (result != PREPARE_SUCCESS) {
+      return result;
+    }
+    if (num > UINT32_MAX || user_id > UINT32_MAX) {
+      return PREPARE_KEY_PART_TOO_LARGE;
+    }
+    num = num << COMPOSITE_KEY_PART_BITS | user_id;
+  }
+  if (*ptr != '\0') {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  if (num > max_key()) {
+    return PREPARE_KEY_TOO_LARGE;
+  }
+  *key = num;
+  return PREPARE_SUCCESS;
+}
+
+/*
+Parses "id = <key>", "id between <low> and <high>" or, on tables with
+composite keys, "tenant = <tenant>" into id_low and id_high
+*/
+PrepareResult prepare_key_range(Statement *statement, char *column, char *op) {
+  PrepareResult result;
+  if (column == NULL || op == NULL) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  if (strcmp(column, "tenant") == 0) {
+    uint64_t tenant;
+    char *token = strtok(NULL, " ");
+    if (!COMPOSITE_KEYS || strcmp(op, "=") != 0 || token == NULL) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    char *end;
+    result = parse_key_part(token, &end, &tenant);
+    if (result != PREPARE_SUCCESS) {
+      return result;
+    }
+    if (*end != '\0') {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    if (tenant > UINT32_MAX) {
+      return PREPARE_KEY_PART_TOO_LARGE;
+    }
+    statement->id_low = tenant << COMPOSITE_KEY_PART_BITS;
+    statement->id_high = statement->id_low | UINT32_MAX;
+  } else if (strcmp(column, "id") != 0) {
+    return PREPARE_SYNTAX_ERROR;
+  } else if (strcmp(op, "=") == 0) {
+    result = parse_key(strtok(NULL, " "), &(statement->id_low));
+    statement->id_high = statement->id_low;
+  } else if (strcmp(op, "between") == 0) {
+    result = parse_key(strtok(NULL, " "), &(statement->id_low));
+    char *token = strtok(NULL, " ");
+    if (result == PREPARE_SUCCESS &&
+        (token == NULL || strcmp(token, "and") != 0)) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    if (result == PREPARE_SUCCESS) {
+      result = parse_key(strtok(NULL, " "), &(statement->id_high));
+    }
+  } else {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  return result;
+}
+
+/*
+update set username=<name>, email=<email> where id = <id>
+update set ... where id between <low> and <high>
+update set ... where tenant = <tenant>
+*/
+PrepareResult prepare_update(Statement *statement) {
+  statement->columns_to_update = 0;
+  memset(&(statement->row_to_update), 0, sizeof(Row));
+  char *token = strtok(NULL, " ");
+  if (token == NULL || strcmp(token, "set") != 0) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  while ((token = strtok(NULL, " ,")) != NULL && strcmp(token, "where")) {
+    char *value = strchr(token, '=');
+    if (value == NULL) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    *value++ = '\0';
+    if (strcmp(token, "username") == 0) {
+      if (strlen(value) > COLUMN_USERNAME_SIZE)
+        return PREPARE_STRING_TOO_LONG;
+      strcpy(statement->row_to_update.username, value);
+      statement->columns_to_update |= UPDATE_USERNAME;
+    } else if (strcmp(token, "email") == 0) {
+      if (strlen(value) > COLUMN_EMAIL_SIZE)
+        return PREPARE_STRING_TOO_LONG;
+      strcpy(statement->row_to_update.email, value);
+      statement->columns_to_update |= UPDATE_EMAIL;
+    } else {
+      return PREPARE_SYNTAX_ERROR;
+    }
+  }
+  if (token == NULL || statement->columns_to_update == 0) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  char *column = strtok(NULL, " ");
+  char *op = strtok(NULL, " ");
+  PrepareResult result = prepare_key_range(statement, column, op);
+  if (result == PREPARE_SUCCESS && strtok(NULL, " ") != NULL) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  return result;
+}
+
+/*
+Parses "<username|email> = <value>" or "<username|email> like <pattern>"
+where the pattern may start and/or end with %. Values may be quoted.
+*/
+PrepareResult prepare_string_filter(StringFilter *filter, char *column,
+                                    char *op) {
+  char *value = strtok(NULL, " ");
+  if (column == NULL || op == NULL || value == NULL) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  if (strcmp(column, "username") == 0) {
+    filter->column = FILTER_COLUMN_USERNAME;
+  } else if (strcmp(column, "email") == 0) {
+    filter->column = FILTER_COLUMN_EMAIL;
+  } else {
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  size_t length = strlen(value);
+  if (length >= 2 && (value[0] == '\'' || value[0] == '"') &&
+      value[length - 1] == value[0]) {
+    value[length - 1] = '\0';
+    value++;
+    length -= 2;
+  }
+
+  filter->kind = FILTER_EQUALS;
+  if (strcmp(op, "like") == 0) {
+    bool leading = length > 0 && value[0] == '%';
+    bool trailing = length > (size_t)leading && value[length - 1] == '%';
+    if (leading) {
+      value++;
+      length--;
+    }
+    if (trailing) {
+      value[--length] = '\0';
+    }
+    if (strchr(value, '%') != NULL) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    if (leading && trailing) {
+      filter->kind = FILTER_CONTAINS;
+    } else if (leading) {
+      filter->kind = FILTER_SUFFIX;
+    } else if (trailing) {
+      filter->kind = FILTER_PREFIX;
+    }
+  } else if (strcmp(op, "=") != 0) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  if (length > COLUMN_EMAIL_SIZE) {
+    return PREPARE_STRING_TOO_LONG;
+  }
+  memset(filter->needle, 0, sizeof(filter->needle));
+  memcpy(filter->needle, value, length);
+  filter->needle_length = length;
+  return PREPARE_SUCCESS;
+}
+
+/*
+Parses "(<id>, <id>, ...)" after "where id in". The list may contain spaces,
+so it is split by hand and tokenizing resumes after the closing parenthesis
+with *next_token.
+*/
+PrepareResult prepare_id_list(Statement *statement, char **next_token) {
+  char *position = strtok(NULL, "");
+  if (position == NULL) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  statement->by_ids = true;
+  statement->num_ids = 0;
+  position += strspn(position, " ");
+  if (*position++ != '(') {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  position += strspn(position, " ");
+  bool closed = *position == ')';
+  if (closed) {
+    position++;
+  }
+  while (!closed) {
+    char *end = position + strcspn(position, " ,)");
+    char separator = *end;
+    *end = '\0';
+    if (statement->num_ids == SELECT_MAX_IDS) {
+      return PREPARE_TOO_MANY_IDS;
+    }
+    PrepareResult result =
+        parse_key(position, &(statement->ids[statement->num_ids++]));
+    if (result != PREPARE_SUCCESS) {
+      return result;
+    }
+    *end = separator;
+    position = end + strspn(end, " ");
+    if (*position != ',' && *position != ')') {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    closed = *position++ == ')';
+    position += strspn(position, " ");
+  }
+  *next_token = strtok(position, " ");
+  return PREPARE_SUCCESS;
+}
+
+/*
+select [where <username|email> = <value> | like <pattern>]
+select [where id in (<id>, ...) | id = <id> | id between <low> and <high>
+        | tenant = <tenant>]
+       [order by <username|email> [asc|desc]] [limit <n>]
+*/
+PrepareResult prepare_select(Statement *statement) {
+  memset(&(statement->filter), 0, sizeof(StringFilter));
+  statement->filter.kind = FILTER_NONE;
+  statement->order_by = false;
+  statement->order_descending = false;
+  statement->limit = SELECT_NO_LIMIT;
+  statement->by_ids = false;
+  statement->by_range = false;
+  PrepareResult result = PREPARE_SUCCESS;
+  char *token = strtok(NULL, " ");
+  if (token != NULL && strcmp(token, "where") == 0) {
+    char *column = strtok(NULL, " ");
+    char *op = strtok(NULL, " ");
+    if (column == NULL || op == NULL) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    if (strcmp(column, "id") == 0 && strcmp(op, "in") == 0) {
+      result = prepare_id_list(statement, &token);
+    } else {
+      if (strcmp(column, "id") == 0 || strcmp(column, "tenant") == 0) {
+        statement->by_range = true;
+        result = prepare_key_range(statement, column, op);
+      } else {
+        result = prepare_string_filter(&(statement->filter), column, op);
+      }
+      token = strtok(NULL, " ");
+    }
+    if (result != PREPARE_SUCCESS) {
+      return result;
+    }
+  }
+  if (token != NULL && strcmp(token, "order") == 0) {
+    token = strtok(NULL, " ");
+    char *column = strtok(NULL, " ");
+    if (token == NULL || strcmp(token, "by") != 0 || column == NULL) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    if (strcmp(column, "username") == 0) {
+      statement->order_column = FILTER_COLUMN_USERNAME;
+    } else if (strcmp(column, "email") == 0) {
+      statement->order_column = FILTER_COLUMN_EMAIL;
+    } else {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    statement->order_by = true;
+    token = strtok(NULL, " ");
+    if (token != NULL &&
+        (strcmp(token, "asc") == 0 || strcmp(token, "desc") == 0)) {
+      statement->order_descending = strcmp(token, "desc") == 0;
+      token = strtok(NULL, " ");
+    }
+  }
+  if (token != NULL && strcmp(token, "limit") == 0) {
+    result = parse_id(strtok(NULL, " "), &(statement->limit));
+    if (result != PREPARE_SUCCESS) {
+      return result;
+    }
+    token = strtok(NULL, " ");
+  }
+  if (token != NULL) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  return PREPARE_SUCCESS;
+}
+
 PrepareResult prepare_statement(InputBuffer *input_buffer,
                                 Statement *statement) {
   int count = 0;
@@ -105,12 +589,10 @@ PrepareResult prepare_statement(InputBuffer *input_buffer,
       token = strtok(NULL, " ");
       if (token != NULL) {
         if (count == 1) {
-          char *ptr;
-          int num = strtol(token, &ptr, 10);
-          if (num >= 0) {
-            statement->row_to_insert.id = (uint32_t)num;
-          } else {
-            return PREPARE_NEGATIVE_ID;
+          PrepareResult result =
+              parse_key(token, &(statement->row_to_insert.id));
+          if (result != PREPARE_SUCCESS) {
+            return result;
           }
         } else if (count == 2) {
           if (strlen(token) > COLUMN_USERNAME_SIZE)
@@ -133,13 +615,16 @@ PrepareResult prepare_statement(InputBuffer *input_buffer,
     return PREPARE_SUCCESS;
   } else if (strcmp(token, select) == 0) {
     statement->type = STATEMENT_SELECT;
-    return PREPARE_SUCCESS;
+    return prepare_select(statement);
+  } else if (strcmp(token, "update") == 0) {
+    statement->type = STATEMENT_UPDATE;
+    return prepare_update(statement);
   } else {
     return PREPARE_UNRECOGNIZED_STATEMENT;
   }
 }
 
-Pager *pager_open(const char *filename) {
+Pager *pager_open(const char *filename, DbOptions *options) {
   int fd = open(filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
   if (fd == -1) {
     printf("Unable to open file\n");
@@ -147,55 +632,204 @@ Pager *pager_open(const char *filename) {
   }
   Pager *pager = (Pager *)calloc(1, sizeof(Pager));
   pager->file_descriptor = fd;
+  pager->filename = strdup(filename);
+  pthread_mutex_init(&(pager->latch), NULL);
+  pthread_cond_init(&(pager->flusher_wakeup), NULL);
   pager->file_length = lseek(fd, 0, SEEK_END);
+  DbHeader *header = &(pager->header);
+
+  if (pager->file_length == 0) {
+    // New db file, db_open writes the header once the root exists
+    memcpy(header->magic, DB_HEADER_MAGIC, DB_HEADER_MAGIC_SIZE);
+    header->format_version = DB_FORMAT_VERSION;
+    header->page_size = options->page_size;
+    header->root_page_num = DB_HEADER_PAGE_NUM + 1;
+    header->num_pages = DB_HEADER_PAGE_NUM + 1;
+    header->freelist_head = 0;
+    header->flags = options->flags;
+    header->key_size = options->key_size;
+    PAGE_SIZE = options->page_size;
+    pager->num_of_pages = header->num_pages;
+  } else {
+    pager_read_header(pager);
+  }
+  KEY_SIZE = header->key_size;
+  COMPOSITE_KEYS = (header->flags & DB_FLAG_COMPOSITE_KEYS) != 0;
+
+  pager_allocate_arena(pager);
+  if (options->direct_io) {
+    pager_enable_direct_io(pager);
+  }
+  return pager;
+}
+
+void pager_read_header(Pager *pager) {
+  int fd = pager->file_descriptor;
+  DbHeader *header = &(pager->header);
+
+  ssize_t bytes_read = pread(fd, header, sizeof(DbHeader), 0);
+  if (bytes_read != sizeof(DbHeader)) {
+    printf("Db file is too short to hold a header. Corrupt file.\n");
+    exit(EXIT_FAILURE);
+  }
+  if (memcmp(header->magic, DB_HEADER_MAGIC, DB_HEADER_MAGIC_SIZE) != 0) {
+    printf("Not a db file.\n");
+    exit(EXIT_FAILURE);
+  }
+  if (header->format_version != DB_FORMAT_VERSION) {
+    printf("Unsupported db format version %d (expected %d).\n",
+           header->format_version, DB_FORMAT_VERSION);
+    exit(EXIT_FAILURE);
+  }
+  if (!is_valid_page_size(header->page_size)) {
+    printf("Invalid page size %d in db header. Corrupt file.\n",
+           header->page_size);
+    exit(EXIT_FAILURE);
+  }
+  if ((header->key_size != sizeof(uint32_t) &&
+       header->key_size != sizeof(uint64_t)) ||
+      ((header->flags & DB_FLAG_COMPOSITE_KEYS) &&
+       header->key_size != sizeof(uint64_t))) {
+    printf("Invalid key size %d in db header. Corrupt file.\n",
+           header->key_size);
+    exit(EXIT_FAILURE);
+  }
+  PAGE_SIZE = header->page_size;
   pager->num_of_pages = (pager->file_length) / PAGE_SIZE;
 
   if (pager->file_length % PAGE_SIZE != 0) {
     printf("Db file is not a whole number of pages. Corrupt file.\n");
     exit(EXIT_FAILURE);
   }
-  return pager;
+  // Pages the background writer added just before a crash are kept
+  if (header->num_pages > pager->num_of_pages) {
+    printf("Db header counts %d pages but file has %d. Corrupt file.\n",
+           header->num_pages, pager->num_of_pages);
+    exit(EXIT_FAILURE);
+  }
+  header->num_pages = pager->num_of_pages;
+  if (header->root_page_num == DB_HEADER_PAGE_NUM ||
+      header->root_page_num >= pager->num_of_pages) {
+    printf("Invalid root page %d in db header. Corrupt file.\n",
+           header->root_page_num);
+    exit(EXIT_FAILURE);
+  }
 }
 
-Table *db_open(const char *filename) {
+Table *db_open(const char *filename, DbOptions *options) {
   Table *table = (Table *)calloc(1, sizeof(Table));
-  table->pager = pager_open(filename);
+  table->hash_index = adaptive_hash_create(options->hash_index_bytes);
+  table->sort_memory_bytes = options->sort_memory_bytes;
+  table->pager = pager_open(filename, options);
   Pager *pager = table->pager;
-  void *root_node = get_page(pager, 0);
-  set_node_root(root_node, true);
+  table->root_page_num = pager->header.root_page_num;
+  if (pager->num_of_pages == table->root_page_num) {
+    // New db file, the root starts out as an empty leaf
+    void *root_node = get_page_for_write(pager, table->root_page_num);
+    if (pager->header.flags & DB_FLAG_COMPRESSED_LEAVES) {
+      initialize_compressed_leaf_node(root_node);
+    } else {
+      initialize_leaf_node(root_node);
+    }
+    set_node_root(root_node, true);
+    // Make the file openable right away, even if it is never closed
+    pager_write_page(pager, table->root_page_num, PAGE_SIZE);
+    pager_write_header(pager);
+  }
+  pager_start_flusher(pager, options);
   return table;
 }
 
 ExecuteResult execute_insert(Statement *statement, Table *table) {
-  void *node = get_page(table->pager, table->root_page_num);
-  if ((*leaf_node_num_cells(node)) >= LEAF_NODE_MAX_CELLS) {
-    return EXECUTE_TABLE_FULL;
-  }
   Row *row_to_insert = &(statement->row_to_insert);
-  uint32_t key = statement->row_to_insert.id;
+  uint64_t key = statement->row_to_insert.id;
   Cursor *cursor = table_find(table, key);
-  if (key == *(leaf_node_key(node, cursor->cell_num))) {
+  void *node = get_page(table->pager, cursor->page_num);
+  if (cursor->cell_num < *leaf_node_num_cells(node) &&
+      key == leaf_node_key(node, cursor->cell_num)) {
+    cursor_close(cursor);
     return EXECUTE_DUPLICATE_KEY;
   }
   leaf_node_insert(cursor, row_to_insert->id, row_to_insert);
-  free(cursor);
+  cursor_close(cursor);
+  pager_advance_epoch(table->pager);
+  return EXECUTE_SUCCESS;
+}
+
+static bool update_cell(Cursor *cursor, void *context) {
+  Statement *statement = (Statement *)context;
+  leaf_node_update(cursor, &(statement->row_to_update),
+                   statement->columns_to_update);
+  return true;
+}
+
+/*
+Rewrites the matching rows inside their leaf cells, the range costs one
+descent (or hash index probe) and each row dirties only its own page
+*/
+ExecuteResult execute_update(Statement *statement, Table *table) {
+  table_walk_range(table, statement->id_low, statement->id_high, update_cell,
+                   statement);
+  pager_advance_epoch(table->pager);
+  return EXECUTE_SUCCESS;
+}
+
+// context is NULL or the number of rows still to print
+bool print_row(Row *row, void *context) {
+  uint32_t *remaining = (uint32_t *)context;
+  if (remaining != NULL && *remaining == 0) {
+    return false;
+  }
+  if (COMPOSITE_KEYS) {
+    printf("(%" PRIu64 ":%" PRIu64 " , %s , %s)\n",
+           row->id >> COMPOSITE_KEY_PART_BITS, row->id & UINT32_MAX,
+           row->username, row->email);
+  } else {
+    printf("(%" PRIu64 " , %s , %s)\n", row->id, row->username, row->email);
+  }
+  return remaining == NULL || --(*remaining) > 0;
+}
+
+// Feeds the rows a select reads, before any order by, to the callback
+void select_rows(Statement *statement, Table *table, RowCallback callback,
+                 void *context) {
+  if (statement->by_ids) {
+    table_multi_find(table, statement->ids, statement->num_ids, callback,
+                     context);
+  } else if (statement->by_range) {
+    table_range_scan(table, statement->id_low, statement->id_high, callback,
+                     context);
+  } else {
+    table_scan(table, &(statement->filter), callback, context);
+  }
+}
+
+ExecuteResult execute_select(Statement *statement, Table *table) {
+  if (statement->order_by) {
+    Sorter sorter;
+    sorter_init(&sorter, statement->order_column, statement->order_descending,
+                statement->limit, table->sort_memory_bytes);
+    select_rows(statement, table, sorter_add, &sorter);
+    sorter_finish(&sorter, print_row, NULL);
+  } else {
+    uint32_t remaining = statement->limit;
+    select_rows(statement, table, print_row, &remaining);
+  }
+  return EXECUTE_SUCCESS;
 }
 
 ExecuteResult execute_statement(Statement *statement, Table *table) {
+  ExecuteResult result = EXECUTE_FAIL;
+  pager_lock(table->pager);
   if (statement->type == STATEMENT_INSERT) {
-    return execute_insert(statement, table);
+    result = execute_insert(statement, table);
+  } else if (statement->type == STATEMENT_UPDATE) {
+    result = execute_update(statement, table);
   } else if (statement->type == STATEMENT_SELECT) {
-    Row row;
-    Cursor *cursor = table_start(table);
-    while (!(cursor->end_of_table)) {
-      deserialize_row(cursor_value(cursor), &row);
-      printf("(%d , %s , %s)\n", row.id, row.username, row.email);
-      cursor_advance(cursor);
-    }
-    free(cursor);
-    return EXECUTE_SUCCESS;
+    result = execute_select(statement, table);
   }
-  return EXECUTE_FAIL;
+  pager_unlock(table->pager);
+  return result;
 }
 
 InputBuffer *new_input_buffer() {
@@ -223,13 +857,14 @@ void close_input_buffer(InputBuffer **input_buffer) {
 }
 
 void *get_page(Pager *pager, uint32_t page_num) {
-  if (page_num > TABLE_MAX_PAGES) {
+  if (page_num >= TABLE_MAX_PAGES) {
     printf("Tried to fetch pages out of bound\n");
     exit(EXIT_FAILURE);
   }
 
   if (pager->pages[page_num] == NULL) {
-    void *page = calloc(1, PAGE_SIZE);
+    void *page = pager->arena + (size_t)page_num * PAGE_SIZE;
+    memset(page, 0, PAGE_SIZE);
     uint32_t num_pages = pager->file_length / PAGE_SIZE;
 
     if (pager->file_length % PAGE_SIZE) {
@@ -252,13 +887,161 @@ void *get_page(Pager *pager, uint32_t page_num) {
   return pager->pages[page_num];
 }
 
+/*
+Starts bringing in a page that will be read soon: a page that is not cached
+is read ahead by the kernel, a cached one is pulled into the CPU cache.
+O_DIRECT reads bypass the kernel cache, so there read-ahead would only cache
+the page twice and is skipped.
+*/
+void pager_prefetch(Pager *pager, uint32_t page_num) {
+  if (page_num >= TABLE_MAX_PAGES) {
+    return;
+  }
+  void *page = pager->pages[page_num];
+  if (page != NULL) {
+    __builtin_prefetch(page);
+    __builtin_prefetch(page + PAGE_SIZE / 2);
+  } else if (!pager->direct_io &&
+             (uint64_t)page_num * PAGE_SIZE < pager->file_length) {
+    posix_fadvise(pager->file_descriptor, (off_t)page_num * PAGE_SIZE,
+                  PAGE_SIZE, POSIX_FADV_WILLNEED);
+  }
+}
+
+void *get_page_for_write(Pager *pager, uint32_t page_num) {
+  void *page = get_page(pager, page_num);
+  pager->dirty[page_num] = true;
+  Snapshot *newest = pager->snapshots;
+  if (newest == NULL || page_num >= pager->snapshot_num_pages) {
+    // No snapshot can reach the old contents of this page
+    return page;
+  }
+  PageVersion **tail = &(pager->versions[page_num]);
+  while (*tail != NULL && (*tail)->next != NULL) {
+    tail = &((*tail)->next);
+  }
+  if (*tail != NULL && (*tail)->epoch >= newest->epoch) {
+    // Every open snapshot is already served by a kept version
+    return page;
+  }
+  PageVersion *version = (PageVersion *)malloc(sizeof(PageVersion));
+  version->epoch = pager->epoch;
+  version->image = malloc(PAGE_SIZE);
+  version->next = NULL;
+  memcpy(version->image, page, PAGE_SIZE);
+  if (*tail == NULL) {
+    *tail = version;
+  } else {
+    (*tail)->next = version;
+  }
+  return page;
+}
+
+void *get_page_version(Pager *pager, uint32_t page_num, uint64_t epoch) {
+  if (page_num < TABLE_MAX_PAGES) {
+    for (PageVersion *version = pager->versions[page_num]; version != NULL;
+         version = version->next) {
+      if (version->epoch >= epoch) {
+        return version->image;
+      }
+    }
+  }
+  return get_page(pager, page_num);
+}
+
+Snapshot *pager_snapshot_begin(Pager *pager) {
+  Snapshot *snapshot = (Snapshot *)malloc(sizeof(Snapshot));
+  snapshot->epoch = pager->epoch;
+  snapshot->next = pager->snapshots;
+  pager->snapshots = snapshot;
+  pager->snapshot_num_pages = pager->num_of_pages;
+  return snapshot;
+}
+
+void pager_snapshot_end(Pager *pager, Snapshot *snapshot) {
+  Snapshot **link = &(pager->snapshots);
+  while (*link != NULL && *link != snapshot) {
+    link = &((*link)->next);
+  }
+  if (*link == NULL) {
+    return;
+  }
+  *link = snapshot->next;
+  free(snapshot);
+  pager_reclaim_versions(pager);
+}
+
+void pager_advance_epoch(Pager *pager) { pager->epoch++; }
+
+void pager_reclaim_versions(Pager *pager) {
+  // Snapshots are pushed in epoch order, so the oldest one is last
+  uint64_t oldest_epoch = UINT64_MAX;
+  for (Snapshot *snapshot = pager->snapshots; snapshot != NULL;
+       snapshot = snapshot->next) {
+    oldest_epoch = snapshot->epoch;
+  }
+  for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
+    while (pager->versions[i] != NULL &&
+           pager->versions[i]->epoch < oldest_epoch) {
+      PageVersion *version = pager->versions[i];
+      pager->versions[i] = version->next;
+      free(version->image);
+      free(version);
+    }
+  }
+}
+
 int main(int argc, char *argv[]) {
   if (argc < 2) {
     printf("Give a database filename.\n");
     exit(EXIT_FAILURE);
   }
   char *filename = argv[1];
-  Table *table = db_open(filename);
+  DbOptions options = {DEFAULT_PAGE_SIZE,
+                       0,
+                       DEFAULT_KEY_SIZE,
+                       ADAPTIVE_HASH_DEFAULT_BYTES,
+                       false,
+                       DEFAULT_FLUSH_PAGES_PER_SECOND,
+                       DEFAULT_DIRTY_RATIO_TARGET,
+                       SORT_DEFAULT_MEMORY_BYTES};
+  for (int i = 2; i < argc; i++) {
+    if (!strcmp(argv[i], "--page-size") && i + 1 < argc) {
+      options.page_size = (uint32_t)strtoul(argv[++i], NULL, 10);
+      if (!is_valid_page_size(options.page_size)) {
+        printf("Page size must be 4096, 8192, 16384, 32768 or 65536.\n");
+        exit(EXIT_FAILURE);
+      }
+    } else if (!strcmp(argv[i], "--key-size") && i + 1 < argc) {
+      options.key_size = (uint32_t)strtoul(argv[++i], NULL, 10);
+      if (options.key_size != sizeof(uint32_t) &&
+          options.key_size != sizeof(uint64_t)) {
+        printf("Key size must be 4 or 8.\n");
+        exit(EXIT_FAILURE);
+      }
+    } else if (!strcmp(argv[i], "--composite-key")) {
+      options.flags |= DB_FLAG_COMPOSITE_KEYS;
+    } else if (!strcmp(argv[i], "--hash-index-bytes") && i + 1 < argc) {
+      options.hash_index_bytes = (uint32_t)strtoul(argv[++i], NULL, 10);
+    } else if (!strcmp(argv[i], "--compress")) {
+      options.flags |= DB_FLAG_COMPRESSED_LEAVES;
+    } else if (!strcmp(argv[i], "--direct")) {
+      options.direct_io = true;
+    } else if (!strcmp(argv[i], "--flush-rate") && i + 1 < argc) {
+      options.flush_pages_per_second = (uint32_t)strtoul(argv[++i], NULL, 10);
+    } else if (!strcmp(argv[i], "--dirty-target") && i + 1 < argc) {
+      options.dirty_ratio_target = (uint32_t)strtoul(argv[++i], NULL, 10);
+    } else if (!strcmp(argv[i], "--sort-memory") && i + 1 < argc) {
+      options.sort_memory_bytes = (uint32_t)strtoul(argv[++i], NULL, 10);
+    } else {
+      printf("Unrecognized option '%s'\n", argv[i]);
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (options.flags & DB_FLAG_COMPOSITE_KEYS) {
+    options.key_size = sizeof(uint64_t);
+  }
+  Table *table = db_open(filename, &options);
 
   InputBuffer *input_buffer = new_input_buffer();
   if (input_buffer == NULL || table == NULL) {
@@ -275,6 +1058,8 @@ int main(int argc, char *argv[]) {
     if (input_buffer->buffer[0] == '.') {
       switch (do_meta_command(input_buffer, table)) {
       case META_COMMAND_SUCCESS:
+        continue;
+      case META_COMMAND_EXIT:
         exit(EXECUTE_SUCCESS);
       case META_COMMAND_UNRECOGNIZED_COMMAND:
         printf("Unrecognized command '%s'\n", input_buffer->buffer);
@@ -291,6 +1076,19 @@ int main(int argc, char *argv[]) {
     case PREPARE_STRING_TOO_LONG:
       printf("String is too long\n");
       continue;
+    case PREPARE_KEY_TOO_LARGE:
+      printf("ID does not fit in the table's %d byte keys\n", KEY_SIZE);
+      continue;
+    case PREPARE_KEY_PART_TOO_LARGE:
+      printf("Tenant and user parts of an ID are limited to %d bits\n",
+             COMPOSITE_KEY_PART_BITS);
+      continue;
+    case PREPARE_COMPOSITE_KEY_EXPECTED:
+      printf("IDs in this table are <tenant>:<user>\n");
+      continue;
+    case PREPARE_TOO_MANY_IDS:
+      printf("At most %d ids fit in one select\n", SELECT_MAX_IDS);
+      continue;
     case PREPARE_SYNTAX_ERROR:
       printf("Syntax error\n");
       continue;
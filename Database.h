@@ -1,29 +1,77 @@
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 typedef enum { BUFFER_CREATED, BUFFER_NOT_CREATED } ReadInputStatus;
 
-typedef enum { STATEMENT_INSERT, STATEMENT_SELECT } StatementType;
+typedef enum {
+  STATEMENT_INSERT,
+  STATEMENT_SELECT,
+  STATEMENT_UPDATE
+} StatementType;
 
 #define COLUMN_USERNAME_SIZE 32
 #define COLUMN_EMAIL_SIZE 255
 typedef struct {
-  uint32_t id;
+  uint64_t id;
   char username[COLUMN_USERNAME_SIZE + 1];
   char email[COLUMN_EMAIL_SIZE + 1];
 } Row;
 
+typedef enum { FILTER_COLUMN_USERNAME, FILTER_COLUMN_EMAIL } FilterColumn;
+
+typedef enum {
+  FILTER_NONE,
+  FILTER_EQUALS,  // col = 'abc' or col like 'abc'
+  FILTER_PREFIX,  // col like 'abc%'
+  FILTER_SUFFIX,  // col like '%abc'
+  FILTER_CONTAINS // col like '%abc%'
+} FilterKind;
+
+typedef struct {
+  FilterKind kind;
+  FilterColumn column;
+  char needle[COLUMN_EMAIL_SIZE + 1];
+  uint32_t needle_length;
+} StringFilter;
+
+#define SELECT_MAX_IDS 1024
+
+// Columns an update statement sets
+#define UPDATE_USERNAME 0x1
+#define UPDATE_EMAIL 0x2
+
 typedef struct {
   StatementType type;
   Row row_to_insert;
+  Row row_to_update;
+  uint32_t columns_to_update;
+  uint64_t id_low;
+  uint64_t id_high;
+  StringFilter filter;
+  bool order_by;
+  FilterColumn order_column;
+  bool order_descending;
+  uint32_t limit; // SELECT_NO_LIMIT when the select has no limit
+  bool by_ids;    // select where id in (...)
+  bool by_range;  // select where id between ... or tenant = ...
+  uint32_t num_ids;
+  uint64_t ids[SELECT_MAX_IDS];
 } Statement;
 
+#define SELECT_NO_LIMIT UINT32_MAX
+
 typedef enum {
   PREPARE_SUCCESS,
   PREPARE_NEGATIVE_ID,
   PREPARE_STRING_TOO_LONG,
+  PREPARE_TOO_MANY_IDS,
+  PREPARE_KEY_TOO_LARGE,
+  PREPARE_KEY_PART_TOO_LARGE,
+  PREPARE_COMPOSITE_KEY_EXPECTED,
   PREPARE_SYNTAX_ERROR,
   PREPARE_UNRECOGNIZED_STATEMENT
 } PrepareResult;
@@ -42,6 +90,7 @@ typedef struct {
 } InputBuffer;
 typedef enum {
   META_COMMAND_SUCCESS,
+  META_COMMAND_EXIT,
   META_COMMAND_UNRECOGNIZED_COMMAND
 } MetaCommandResult;
 
@@ -54,23 +103,207 @@ extern const uint32_t ID_OFFSET;
 extern const uint32_t USERNAME_OFFSET;
 extern const uint32_t EMAIL_OFFSET;
 extern const uint32_t ROW_SIZE;
-extern const uint32_t PAGE_SIZE;
+extern uint32_t PAGE_SIZE;
+extern uint32_t KEY_SIZE;
+extern bool COMPOSITE_KEYS;
 
 #define TABLE_MAX_PAGES 100
 
+/*
+ * Page size is chosen when the db file is created and recorded in the
+ * header, every node layout below is derived from it at runtime.
+ */
+#define DEFAULT_PAGE_SIZE 4096
+#define MIN_PAGE_SIZE 4096
+#define MAX_PAGE_SIZE 65536
+
+/*
+ * Key width is also fixed at creation: 4 byte keys, or 8 byte keys which
+ * may be composite (tenant:user, the tenant in the high 32 bits). Keys are
+ * stored big-endian so their byte order is their numeric order, and are
+ * compared after one load and byte swap.
+ */
+#define DEFAULT_KEY_SIZE sizeof(uint32_t)
+#define MAX_KEY_SIZE sizeof(uint64_t)
+#define COMPOSITE_KEY_PART_BITS 32
+
 void serialize_row(Row *source, void *destination);
 void deserialize_row(void *source, Row *destination);
 
+/*
+ * File Header Layout
+ * Page 0 of the db file holds the header, table pages start at page 1 so
+ * page number 0 is free to act as the "no page" value in leaf chains.
+ */
+#define DB_HEADER_MAGIC "BSTARDB"
+#define DB_HEADER_MAGIC_SIZE 8
+#define DB_FORMAT_VERSION 3
+#define DB_HEADER_PAGE_NUM 0
+
+// Header flags, fixed when the db file is created
+#define DB_FLAG_COMPRESSED_LEAVES 0x1
+#define DB_FLAG_COMPOSITE_KEYS 0x2
+
+typedef struct {
+  char magic[DB_HEADER_MAGIC_SIZE];
+  uint32_t format_version;
+  uint32_t page_size;
+  uint32_t root_page_num;
+  uint32_t num_pages;
+  uint32_t freelist_head;
+  uint32_t flags;
+  uint32_t key_size;
+} DbHeader;
+
+/*
+ * Copy-on-write page versions
+ * Every write statement runs in its own epoch. The first time a page is
+ * written in an epoch while a snapshot still needs its old contents, the
+ * old image is kept as a PageVersion tagged with that epoch. A snapshot
+ * taken at epoch E reads the oldest version tagged >= E, or the live page
+ * if the page has not been written since.
+ */
+typedef struct page_version_t {
+  uint64_t epoch;
+  void *image;
+  struct page_version_t *next;
+} PageVersion;
+
+typedef struct snapshot_t {
+  uint64_t epoch;
+  struct snapshot_t *next;
+} Snapshot;
+
+/*
+ * Page frames come from one arena of TABLE_MAX_PAGES frames, frame i caches
+ * page i. Frames are aligned so the pager can bypass the kernel page cache
+ * with O_DIRECT, in which case every read and write is one whole page. An
+ * arena of at least HUGE_PAGE_SIZE is aligned to it and asks for huge pages.
+ */
+#define PAGE_FRAME_ALIGNMENT 4096
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/*
+ * Background writer
+ * A flusher thread trickles dirty pages to disk in page number order, about
+ * flush_pages_per_second of them, and works through them without pausing
+ * while more than dirty_ratio_target percent of the cache is dirty.
+ * Statements hold the pager latch while they run, the flusher only takes it
+ * to copy a page out and does the write itself without it.
+ */
+#define FLUSHER_TICKS_PER_SECOND 10
+#define DEFAULT_FLUSH_PAGES_PER_SECOND 100
+#define DEFAULT_DIRTY_RATIO_TARGET 10
+
+typedef struct {
+  uint32_t page_size; // only used when the db file is created
+  uint32_t flags;     // only used when the db file is created
+  uint32_t key_size;  // only used when the db file is created
+  uint32_t hash_index_bytes;
+  bool direct_io;
+  uint32_t flush_pages_per_second; // 0 disables the background writer
+  uint32_t dirty_ratio_target;     // percent of TABLE_MAX_PAGES
+  uint32_t sort_memory_bytes;
+} DbOptions;
+
 typedef struct pager_t {
   int file_descriptor;
-  uint32_t file_length;
+  char *filename;
+  uint32_t file_length; // grows as pages past the end are written
   uint32_t num_of_pages;
+  DbHeader header;
+  bool direct_io;
+  void *arena;
   void *pages[TABLE_MAX_PAGES];
+  bool dirty[TABLE_MAX_PAGES];
+  pthread_mutex_t latch;
+  pthread_cond_t flusher_wakeup;
+  pthread_t flusher;
+  bool flusher_running;
+  bool flusher_stop;
+  uint32_t flush_pages_per_second;
+  uint32_t dirty_ratio_target;
+  uint32_t flush_position;
+  void *flush_buffer;
+  uint64_t pages_flushed_in_background;
+  uint64_t epoch;
+  Snapshot *snapshots;
+  uint32_t snapshot_num_pages;
+  PageVersion *versions[TABLE_MAX_PAGES];
 } Pager;
 
+/*
+ * Adaptive Hash Index
+ * Maps hot keys straight to their (leaf page, cell). A key is only given a
+ * position once it has been found ADAPTIVE_HASH_BUILD_THRESHOLD times, until
+ * then its entry just counts lookups. Entries are checked against the leaf
+ * on every probe, so inserts and splits that move cells never return a wrong
+ * row: the entry is fixed up within the same leaf or dropped.
+ */
+#define ADAPTIVE_HASH_DEFAULT_BYTES (64 * 1024)
+#define ADAPTIVE_HASH_PROBE_WINDOW 8
+#define ADAPTIVE_HASH_BUILD_THRESHOLD 2
+
+typedef struct {
+  uint64_t key;
+  uint32_t page_num; // INVALID_PAGE_NUM while the key is only counted
+  uint32_t cell_num;
+  uint32_t lookups;
+  bool used;
+} AdaptiveHashEntry;
+
+typedef struct {
+  AdaptiveHashEntry *entries;
+  uint32_t capacity;
+  uint32_t num_entries;
+  uint64_t lookups; // of keys that exist, the hit rate is hits / lookups
+  uint64_t hits;
+  uint64_t misses; // probes for missing keys, e.g. every insert
+  uint64_t fixups;
+  uint64_t invalidations;
+  uint64_t evictions;
+} AdaptiveHashIndex;
+
+/*
+ * Sort
+ * Rows for order by are collected into a buffer of at most
+ * sort_memory_bytes. A full buffer is sorted and spilled to a temporary
+ * file as a run, and the runs are merged SORT_MERGE_FAN_IN at a time at the
+ * end. With a limit that fits the budget only the best rows are kept, in a
+ * heap, and nothing is spilled.
+ */
+#define SORT_DEFAULT_MEMORY_BYTES (1024 * 1024)
+#define SORT_MERGE_FAN_IN 16
+
+typedef struct {
+  FilterColumn column;
+  bool descending;
+  uint32_t limit;
+  Row *rows;
+  uint32_t num_rows;
+  uint32_t capacity; // rows allocated so far
+  uint32_t max_rows; // rows that fit in the memory budget
+  bool top_n;        // rows is a heap of the best limit rows
+  FILE **runs;
+  uint32_t num_runs;
+} Sorter;
+
+/*
+ * Vacuum
+ * Rebuilds the table into <db file>.vacuum: leaves filled to the fill
+ * factor and laid out in key order from page 1, then each internal level
+ * in turn with the root last. The new file replaces the old one with a
+ * rename once it is synced.
+ */
+#define VACUUM_DEFAULT_FILL_PERCENT 90
+#define VACUUM_MIN_FILL_PERCENT 50
+#define VACUUM_FILE_SUFFIX ".vacuum"
+
 typedef struct table_t {
   Pager *pager;
   uint32_t root_page_num;
+  AdaptiveHashIndex *hash_index; // NULL when disabled
+  uint32_t sort_memory_bytes;
 } Table;
 
 typedef struct cursor_t {
@@ -78,6 +311,8 @@ typedef struct cursor_t {
   uint32_t page_num;
   uint32_t cell_num;
   bool end_of_table;
+  Snapshot *snapshot; // NULL for cursors that see the live tree
+  void *value_buffer; // decoded row when the leaf is compressed
 } Cursor;
 
 typedef enum { NODE_INTERNAL, NODE_LEAF } NodeType;
@@ -104,14 +339,19 @@ typedef enum { NODE_INTERNAL, NODE_LEAF } NodeType;
 #define LEAF_NODE_NEXT_LEAF_SIZE sizeof(uint32_t)
 #define LEAF_NODE_NEXT_LEAF_OFFSET                                             \
   (LEAF_NODE_NUM_CELLS_OFFSET + LEAF_NODE_NUM_CELLS_SIZE)
+#define LEAF_NODE_FLAGS_SIZE sizeof(uint8_t)
+#define LEAF_NODE_FLAGS_OFFSET                                                 \
+  (LEAF_NODE_NEXT_LEAF_OFFSET + LEAF_NODE_NEXT_LEAF_SIZE)
 #define LEAF_NODE_HEADER_SIZE                                                  \
   (COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE +                        \
-   LEAF_NODE_NEXT_LEAF_SIZE)
+   LEAF_NODE_NEXT_LEAF_SIZE + LEAF_NODE_FLAGS_SIZE)
+
+#define LEAF_NODE_FLAG_COMPRESSED 0x1
 
 /*
  * Leaf Node Body Layout
  */
-#define LEAF_NODE_KEY_SIZE sizeof(uint32_t)
+#define LEAF_NODE_KEY_SIZE KEY_SIZE
 #define LEAF_NODE_KEY_OFFSET 0
 #define LEAF_NODE_VALUE_SIZE ROW_SIZE
 #define LEAF_NODE_VALUE_OFFSET (LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE)
@@ -122,6 +362,36 @@ typedef enum { NODE_INTERNAL, NODE_LEAF } NodeType;
 #define LEAF_NODE_LEFT_SPLIT_COUNT                                             \
   (LEAF_NODE_MAX_CELLS - LEAF_NODE_RIGHT_SPLIT_COUNT + 1)
 
+/*
+ * Compressed Leaf Node Layout
+ * After the leaf header comes a page-local dictionary of email domains
+ * (length-prefixed strings, addressed by their index), then one slot per
+ * cell holding the key and the page offset of its record. Records are
+ * packed down from the end of the page, inserts go into the gap between
+ * the slots and the records. A record is
+ *   [username prefix length][username suffix length][suffix]
+ *   [domain code][email part length][email part]
+ * where the username prefix is shared with the previous cell (a prefix
+ * length of 0 is a restart, at most COMPRESSED_LEAF_RESTART_INTERVAL cells
+ * apart) and the email part is the local part when the domain is in the
+ * dictionary, else the whole email.
+ */
+#define COMPRESSED_LEAF_DICT_COUNT_SIZE sizeof(uint8_t)
+#define COMPRESSED_LEAF_DICT_COUNT_OFFSET LEAF_NODE_HEADER_SIZE
+#define COMPRESSED_LEAF_SLOTS_OFFSET_SIZE sizeof(uint16_t)
+#define COMPRESSED_LEAF_SLOTS_OFFSET_OFFSET                                    \
+  (COMPRESSED_LEAF_DICT_COUNT_OFFSET + COMPRESSED_LEAF_DICT_COUNT_SIZE)
+#define COMPRESSED_LEAF_HEADER_SIZE                                            \
+  (LEAF_NODE_HEADER_SIZE + COMPRESSED_LEAF_DICT_COUNT_SIZE +                   \
+   COMPRESSED_LEAF_SLOTS_OFFSET_SIZE)
+#define COMPRESSED_LEAF_SLOT_KEY_SIZE KEY_SIZE
+#define COMPRESSED_LEAF_SLOT_RECORD_SIZE sizeof(uint16_t)
+#define COMPRESSED_LEAF_SLOT_SIZE                                              \
+  (COMPRESSED_LEAF_SLOT_KEY_SIZE + COMPRESSED_LEAF_SLOT_RECORD_SIZE)
+#define COMPRESSED_LEAF_MAX_DOMAINS 16
+#define COMPRESSED_LEAF_NO_DOMAIN 0xFF
+#define COMPRESSED_LEAF_RESTART_INTERVAL 8
+
 /*
  * Internal Node Header Layout
  */
@@ -137,25 +407,78 @@ typedef enum { NODE_INTERNAL, NODE_LEAF } NodeType;
 /*
  * Internal Node Body Layout
  */
-#define INTERNAL_NODE_KEY_SIZE sizeof(uint32_t)
+#define INTERNAL_NODE_KEY_SIZE KEY_SIZE
 #define INTERNAL_NODE_CHILD_SIZE sizeof(uint32_t)
 #define INTERNAL_NODE_CELL_SIZE                                                \
   (INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE)
-#define INTERNAL_NODE_MAX_CELLS 3 // small for testing
+#define INTERNAL_NODE_SPACE_FOR_CELLS (PAGE_SIZE - INTERNAL_NODE_HEADER_SIZE)
+#define INTERNAL_NODE_MAX_CELLS                                                \
+  (INTERNAL_NODE_SPACE_FOR_CELLS / INTERNAL_NODE_CELL_SIZE)
 
 void *get_page(Pager *pager, uint32_t page_num);
+void *get_page_for_write(Pager *pager, uint32_t page_num);
+void *get_page_version(Pager *pager, uint32_t page_num, uint64_t epoch);
+Snapshot *pager_snapshot_begin(Pager *pager);
+void pager_snapshot_end(Pager *pager, Snapshot *snapshot);
+void pager_advance_epoch(Pager *pager);
+void pager_reclaim_versions(Pager *pager);
 Cursor *table_start(Table *table);
-Cursor *table_find(Table *table, uint32_t key);
+Cursor *table_find(Table *table, uint64_t key);
+Cursor *table_seek(Table *table, uint64_t key);
 void *cursor_value(Cursor *cursor);
 void cursor_advance(Cursor *cursor);
+void *cursor_page(Cursor *cursor, uint32_t page_num);
+void cursor_close(Cursor *cursor);
 void pager_flush(Pager *pager, uint32_t page_num, uint32_t size);
+void pager_write_page(Pager *pager, uint32_t page_num, uint32_t size);
+void pager_note_written(Pager *pager, uint32_t page_num);
 uint32_t get_unused_page_num(Pager *pager);
 void db_close(Table *table);
+uint32_t db_checkpoint(Table *table);
+void pager_free(Pager *pager);
+bool db_vacuum(Table *table, uint32_t fill_percent);
+void pager_lock(Pager *pager);
+void pager_unlock(Pager *pager);
+void pager_start_flusher(Pager *pager, DbOptions *options);
+void pager_stop_flusher(Pager *pager);
+uint32_t pager_num_dirty_pages(Pager *pager);
+
+// Returning false stops the scan
+typedef bool (*RowCallback)(Row *row, void *context);
+bool print_row(Row *row, void *context);
+bool string_filter_match(StringFilter *filter, const uint8_t *field,
+                         uint32_t size);
+void table_scan(Table *table, StringFilter *filter, RowCallback callback,
+                void *context);
+void table_multi_find(Table *table, uint64_t *keys, uint32_t num_keys,
+                      RowCallback callback, void *context);
+// Called with the cursor on each cell of a key range, false stops the walk
+typedef bool (*CellCallback)(Cursor *cursor, void *context);
+void table_walk_range(Table *table, uint64_t low, uint64_t high,
+                      CellCallback callback, void *context);
+void table_range_scan(Table *table, uint64_t low, uint64_t high,
+                      RowCallback callback, void *context);
+void pager_prefetch(Pager *pager, uint32_t page_num);
+void sorter_init(Sorter *sorter, FilterColumn column, bool descending,
+                 uint32_t limit, uint32_t memory_bytes);
+bool sorter_add(Row *row, void *context);
+void sorter_finish(Sorter *sorter, RowCallback callback, void *context);
 MetaCommandResult do_meta_command(InputBuffer *input_buffer, Table *table);
 PrepareResult prepare_statement(InputBuffer *input_buffer,
                                 Statement *statement);
-Pager *pager_open(const char *filename);
-Table *db_open(const char *filename);
+bool is_valid_page_size(uint32_t page_size);
+void pager_write_header(Pager *pager);
+void pager_read_header(Pager *pager);
+void pager_allocate_arena(Pager *pager);
+void pager_enable_direct_io(Pager *pager);
+Pager *pager_open(const char *filename, DbOptions *options);
+Table *db_open(const char *filename, DbOptions *options);
+AdaptiveHashIndex *adaptive_hash_create(uint32_t max_bytes);
+void adaptive_hash_free(AdaptiveHashIndex *index);
+void adaptive_hash_clear(AdaptiveHashIndex *index);
+Cursor *adaptive_hash_lookup(Table *table, uint64_t key);
+void adaptive_hash_record(Table *table, uint64_t key, Cursor *cursor);
+void adaptive_hash_print_stats(AdaptiveHashIndex *index);
 ExecuteResult execute_statement(Statement *statement, Table *table);
 InputBuffer *new_input_buffer();
 ReadInputStatus read_input(InputBuffer *input_buffer);
@@ -163,11 +486,16 @@ void close_input_buffer(InputBuffer **input_buffer);
 
 uint32_t *leaf_node_num_cells(void *node);
 void *leaf_node_cell(void *node, uint32_t cell_num);
-uint32_t *leaf_node_key(void *node, uint32_t cell_num);
+uint64_t key_decode(const void *source);
+void key_encode(void *destination, uint64_t key);
+uint64_t max_key();
+uint64_t leaf_node_key(void *node, uint32_t cell_num);
+void set_leaf_node_key(void *node, uint32_t cell_num, uint64_t key);
 void *leaf_node_value(void *node, uint32_t cell_num);
 void *initialize_leaf_node(void *node);
-void leaf_node_insert(Cursor *cursor, uint32_t key, Row *value);
-void leaf_node_split_and_insert(Cursor *cursor, uint32_t key, Row *value);
+void leaf_node_insert(Cursor *cursor, uint64_t key, Row *value);
+void leaf_node_update(Cursor *cursor, Row *value, uint32_t columns);
+void leaf_node_split_and_insert(Cursor *cursor, uint64_t key, Row *value);
 NodeType get_node_type(void *node);
 void set_node_type(void *node, NodeType type);
 void create_new_root(Table *table, uint32_t right_child_page_num);
@@ -175,17 +503,32 @@ uint32_t *internal_node_num_keys(void *node);
 uint32_t *internal_node_right_child(void *node);
 uint32_t *internal_node_cell(void *node, uint32_t cell_num);
 uint32_t *internal_node_child(void *node, uint32_t child_num);
-uint32_t *internal_node_key(void *node, uint32_t key_num);
-uint32_t get_node_max_key(void *node);
+uint64_t internal_node_key(void *node, uint32_t key_num);
+void set_internal_node_key(void *node, uint32_t key_num, uint64_t key);
+uint64_t get_node_max_key(void *node);
 bool is_node_root(void *node);
 void set_node_root(void *node, bool is_root);
-Cursor *leaf_node_find(Table *table, uint32_t page_num, uint32_t key);
-Cursor *internal_node_find(Table *table, uint32_t page_num, uint32_t key);
-uint32_t internal_node_find_child(void *node, uint32_t key);
-void update_internal_node_key(void *node, uint32_t old_key, uint32_t new_key);
+Cursor *leaf_node_find(Table *table, uint32_t page_num, uint64_t key);
+Cursor *internal_node_find(Table *table, uint32_t page_num, uint64_t key);
+uint32_t internal_node_find_child(void *node, uint64_t key);
+void update_internal_node_key(void *node, uint64_t old_key, uint64_t new_key);
 void internal_node_insert(Table *table, uint32_t parent_page_num,
                           uint32_t child_page_num);
 uint32_t *leaf_node_next_leaf(void *node);
+uint8_t *leaf_node_flags(void *node);
+void leaf_node_split_update_parent(Table *table, void *old_node,
+                                   uint64_t old_max, uint32_t new_page_num);
+bool is_leaf_node_compressed(void *node);
+void initialize_compressed_leaf_node(void *node);
+bool compressed_leaf_encode(void *node, Row *rows, uint32_t num_rows);
+void compressed_leaf_decode_row(void *node, uint32_t cell_num, Row *row);
+void compressed_leaf_insert(Cursor *cursor, uint64_t key, Row *value);
+void compressed_leaf_update(Cursor *cursor, Row *value, uint32_t columns);
+void compressed_leaf_store(Table *table, uint32_t page_num, Row *rows,
+                           uint32_t num_rows);
+uint8_t compressed_leaf_domain_code(void *node, const char *domain,
+                                    uint32_t length);
+uint8_t compressed_leaf_row_domain_code(void *node, uint32_t cell_num);
 uint32_t *node_parent(void *node);
 void internal_node_split_and_insert(Table *table, uint32_t parent_page_num,
                                     uint32_t child_page_num);
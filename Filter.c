@@ -0,0 +1,289 @@
+#include "Database.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__) && defined(__SSE2__)
+#define STRING_KERNELS_X86
+#include <immintrin.h>
+#endif
+
+/*
+String predicate kernels
+They run on the fixed-size column bytes inside the leaf: a field is a NUL
+terminated string padded to its column size. Vector loads never go past
+the end of the field, the last partial block is handled byte by byte.
+*/
+
+typedef struct {
+  uint32_t (*field_length)(const uint8_t *field, uint32_t size);
+  bool (*contains)(const uint8_t *field, uint32_t length, uint32_t size,
+                   const uint8_t *needle, uint32_t needle_length);
+} StringKernels;
+
+static bool bytes_equal(const uint8_t *a, const uint8_t *b, uint32_t n) {
+  uint32_t i = 0;
+#ifdef STRING_KERNELS_X86
+  for (; i + 16 <= n; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+    __m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) != 0xFFFF) {
+      return false;
+    }
+  }
+#endif
+  return memcmp(a + i, b + i, n - i) == 0;
+}
+
+// Never reads past the field, even if length was not bounded by its size
+static bool contains_scalar(const uint8_t *field, uint32_t length,
+                            uint32_t size, const uint8_t *needle,
+                            uint32_t needle_length) {
+  uint32_t end = length < size ? length : size;
+  for (uint32_t i = 0; i + needle_length <= end; i++) {
+    if (field[i] == needle[0] &&
+        bytes_equal(field + i, needle, needle_length)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+#ifndef STRING_KERNELS_X86
+static uint32_t field_length_scalar(const uint8_t *field, uint32_t size) {
+  return strnlen((const char *)field, size);
+}
+#else
+static uint32_t field_length_sse2(const uint8_t *field, uint32_t size) {
+  const __m128i zero = _mm_setzero_si128();
+  uint32_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    __m128i block = _mm_loadu_si128((const __m128i *)(field + i));
+    uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, zero));
+    if (mask) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+  for (; i < size; i++) {
+    if (field[i] == 0) {
+      return i;
+    }
+  }
+  return size;
+}
+
+/*
+Compares the first and last byte of the needle at 16 positions at once and
+only checks the middle of the needle where both match
+*/
+static bool contains_sse2(const uint8_t *field, uint32_t length, uint32_t size,
+                          const uint8_t *needle, uint32_t needle_length) {
+  const __m128i first = _mm_set1_epi8((char)needle[0]);
+  const __m128i last = _mm_set1_epi8((char)needle[needle_length - 1]);
+  uint32_t last_position = length - needle_length;
+  uint32_t i = 0;
+  for (; i <= last_position && i + needle_length - 1 + 16 <= size; i += 16) {
+    __m128i block_first = _mm_loadu_si128((const __m128i *)(field + i));
+    __m128i block_last =
+        _mm_loadu_si128((const __m128i *)(field + i + needle_length - 1));
+    uint32_t mask = _mm_movemask_epi8(_mm_and_si128(
+        _mm_cmpeq_epi8(block_first, first), _mm_cmpeq_epi8(block_last, last)));
+    if (last_position - i < 15) {
+      mask &= (1u << (last_position - i + 1)) - 1;
+    }
+    while (mask) {
+      uint32_t position = i + __builtin_ctz(mask);
+      if (bytes_equal(field + position, needle, needle_length)) {
+        return true;
+      }
+      mask &= mask - 1;
+    }
+  }
+  if (i > last_position) {
+    return false;
+  }
+  return contains_scalar(field + i, length - i, size - i, needle,
+                         needle_length);
+}
+
+__attribute__((target("avx2"))) static uint32_t
+field_length_avx2(const uint8_t *field, uint32_t size) {
+  const __m256i zero = _mm256_setzero_si256();
+  uint32_t i = 0;
+  for (; i + 32 <= size; i += 32) {
+    __m256i block = _mm256_loadu_si256((const __m256i *)(field + i));
+    uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, zero));
+    if (mask) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+  return i + field_length_sse2(field + i, size - i);
+}
+
+__attribute__((target("avx2"))) static bool
+contains_avx2(const uint8_t *field, uint32_t length, uint32_t size,
+              const uint8_t *needle, uint32_t needle_length) {
+  const __m256i first = _mm256_set1_epi8((char)needle[0]);
+  const __m256i last = _mm256_set1_epi8((char)needle[needle_length - 1]);
+  uint32_t last_position = length - needle_length;
+  uint32_t i = 0;
+  for (; i <= last_position && i + needle_length - 1 + 32 <= size; i += 32) {
+    __m256i block_first = _mm256_loadu_si256((const __m256i *)(field + i));
+    __m256i block_last =
+        _mm256_loadu_si256((const __m256i *)(field + i + needle_length - 1));
+    uint32_t mask = _mm256_movemask_epi8(
+        _mm256_and_si256(_mm256_cmpeq_epi8(block_first, first),
+                         _mm256_cmpeq_epi8(block_last, last)));
+    if (last_position - i < 31) {
+      mask &= (1u << (last_position - i + 1)) - 1;
+    }
+    while (mask) {
+      uint32_t position = i + __builtin_ctz(mask);
+      if (bytes_equal(field + position, needle, needle_length)) {
+        return true;
+      }
+      mask &= mask - 1;
+    }
+  }
+  if (i > last_position) {
+    return false;
+  }
+  return contains_sse2(field + i, length - i, size - i, needle,
+                       needle_length);
+}
+#endif
+
+static StringKernels *string_kernels() {
+  static StringKernels kernels = {NULL, NULL};
+  if (kernels.field_length == NULL) {
+#ifdef STRING_KERNELS_X86
+    if (__builtin_cpu_supports("avx2")) {
+      kernels = (StringKernels){field_length_avx2, contains_avx2};
+    } else {
+      kernels = (StringKernels){field_length_sse2, contains_sse2};
+    }
+#else
+    kernels = (StringKernels){field_length_scalar, contains_scalar};
+#endif
+  }
+  return &kernels;
+}
+
+/*
+The needle is NUL padded, so equality is a compare of the needle and its
+terminator against the start of the field
+*/
+bool string_filter_match(StringFilter *filter, const uint8_t *field,
+                         uint32_t size) {
+  const uint8_t *needle = (const uint8_t *)filter->needle;
+  uint32_t needle_length = filter->needle_length;
+  if (needle_length > size) {
+    return false;
+  }
+  uint32_t length;
+  switch (filter->kind) {
+  case FILTER_NONE:
+    return true;
+  case FILTER_EQUALS:
+    return bytes_equal(field, needle,
+                       needle_length < size ? needle_length + 1 : size);
+  case FILTER_PREFIX:
+    return bytes_equal(field, needle, needle_length);
+  case FILTER_SUFFIX:
+    length = string_kernels()->field_length(field, size);
+    return length >= needle_length &&
+           bytes_equal(field + length - needle_length, needle, needle_length);
+  case FILTER_CONTAINS:
+    if (needle_length == 0) {
+      return true;
+    }
+    length = string_kernels()->field_length(field, size);
+    return length >= needle_length &&
+           string_kernels()->contains(field, length, size, needle,
+                                      needle_length);
+  }
+  return false;
+}
+
+// Returns false once the callback asks to stop
+static bool scan_compressed_leaf(void *node, StringFilter *filter,
+                                 RowCallback callback, void *context) {
+  Row row;
+  uint32_t num_cells = *leaf_node_num_cells(node);
+
+  // '%@domain' is answered from the page dictionary for coded rows
+  bool by_domain = filter->kind == FILTER_SUFFIX &&
+                   filter->column == FILTER_COLUMN_EMAIL &&
+                   filter->needle[0] == '@' &&
+                   memchr(filter->needle + 1, '@', filter->needle_length - 1) ==
+                       NULL;
+  uint8_t wanted_code = COMPRESSED_LEAF_NO_DOMAIN;
+  if (by_domain) {
+    wanted_code = compressed_leaf_domain_code(node, filter->needle + 1,
+                                              filter->needle_length - 1);
+  }
+
+  for (uint32_t i = 0; i < num_cells; i++) {
+    if (by_domain) {
+      uint8_t code = compressed_leaf_row_domain_code(node, i);
+      if (code != COMPRESSED_LEAF_NO_DOMAIN) {
+        if (code == wanted_code) {
+          compressed_leaf_decode_row(node, i, &row);
+          if (!callback(&row, context)) {
+            return false;
+          }
+        }
+        continue;
+      }
+    }
+    compressed_leaf_decode_row(node, i, &row);
+    const uint8_t *field = filter->column == FILTER_COLUMN_USERNAME
+                               ? (const uint8_t *)row.username
+                               : (const uint8_t *)row.email;
+    uint32_t size = filter->column == FILTER_COLUMN_USERNAME ? USERNAME_SIZE
+                                                             : EMAIL_SIZE;
+    if (string_filter_match(filter, field, size) && !callback(&row, context)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+Walks the leaf chain of a snapshot and hands every row that passes the
+filter to the callback until it returns false. Rows are tested on the column
+bytes in the page, only matching rows are copied out.
+*/
+void table_scan(Table *table, StringFilter *filter, RowCallback callback,
+                void *context) {
+  Cursor *cursor = table_start(table);
+  uint32_t offset = filter->column == FILTER_COLUMN_USERNAME ? USERNAME_OFFSET
+                                                             : EMAIL_OFFSET;
+  uint32_t size = filter->column == FILTER_COLUMN_USERNAME ? USERNAME_SIZE
+                                                           : EMAIL_SIZE;
+  uint32_t page_num = cursor->page_num;
+  bool more = true;
+  while (more && !cursor->end_of_table) {
+    void *node = cursor_page(cursor, page_num);
+    if (is_leaf_node_compressed(node)) {
+      more = scan_compressed_leaf(node, filter, callback, context);
+    } else {
+      Row row;
+      uint32_t num_cells = *leaf_node_num_cells(node);
+      for (uint32_t i = 0; more && i < num_cells; i++) {
+        void *value = leaf_node_value(node, i);
+        if (string_filter_match(filter, value + offset, size)) {
+          deserialize_row(value, &row);
+          more = callback(&row, context);
+        }
+      }
+    }
+    page_num = *leaf_node_next_leaf(node);
+    if (page_num == 0) {
+      break;
+    }
+  }
+  cursor_close(cursor);
+}
@@ -0,0 +1,150 @@
+#include "Database.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+void pager_lock(Pager *pager) { pthread_mutex_lock(&(pager->latch)); }
+
+void pager_unlock(Pager *pager) { pthread_mutex_unlock(&(pager->latch)); }
+
+uint32_t pager_num_dirty_pages(Pager *pager) {
+  uint32_t num_dirty = 0;
+  for (uint32_t i = 0; i < pager->num_of_pages; i++) {
+    if (pager->pages[i] != NULL && pager->dirty[i]) {
+      num_dirty++;
+    }
+  }
+  return num_dirty;
+}
+
+/*
+Finds the next dirty page at or after flush_position, wrapping around once
+*/
+static bool pager_next_dirty_page(Pager *pager, uint32_t *page_num) {
+  uint32_t num_pages = pager->num_of_pages;
+  for (uint32_t i = 0; i < num_pages; i++) {
+    uint32_t candidate = (pager->flush_position + i) % num_pages;
+    if (pager->pages[candidate] != NULL && pager->dirty[candidate]) {
+      *page_num = candidate;
+      pager->flush_position = candidate + 1;
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool pager_over_dirty_target(Pager *pager) {
+  return pager_num_dirty_pages(pager) * 100 >
+         pager->dirty_ratio_target * TABLE_MAX_PAGES;
+}
+
+/*
+Called with the latch held, returns with it held. When the page grows the
+file the header is snapshotted under the latch and written after the page,
+both without the latch, so statements never wait on either write.
+*/
+static void pager_flusher_write(Pager *pager, uint32_t page_num) {
+  memcpy(pager->flush_buffer, pager->pages[page_num], PAGE_SIZE);
+  pager->dirty[page_num] = false;
+  bool grows_file = page_num >= pager->header.num_pages;
+  DbHeader header = pager->header;
+  header.num_pages = page_num + 1;
+  pager_unlock(pager);
+
+  ssize_t status = pwrite(pager->file_descriptor, pager->flush_buffer,
+                          PAGE_SIZE, (off_t)page_num * PAGE_SIZE);
+  if (status == PAGE_SIZE && grows_file) {
+    // The page is on disk, so the buffer is free for the header page
+    memset(pager->flush_buffer, 0, PAGE_SIZE);
+    memcpy(pager->flush_buffer, &header, sizeof(DbHeader));
+    if (pwrite(pager->file_descriptor, pager->flush_buffer, PAGE_SIZE,
+               DB_HEADER_PAGE_NUM * PAGE_SIZE) != PAGE_SIZE) {
+      grows_file = false;
+    }
+  }
+
+  pager_lock(pager);
+  if (status != PAGE_SIZE) {
+    // Leave it for the next pass or for db_close
+    pager->dirty[page_num] = true;
+    return;
+  }
+  pager->pages_flushed_in_background++;
+  pager_note_written(pager, page_num);
+  if (grows_file && header.num_pages > pager->header.num_pages) {
+    pager->header.num_pages = header.num_pages;
+  }
+}
+
+static void *pager_flusher_main(void *arg) {
+  Pager *pager = arg;
+  uint32_t pages_per_tick =
+      pager->flush_pages_per_second / FLUSHER_TICKS_PER_SECOND;
+  if (pages_per_tick == 0) {
+    pages_per_tick = 1;
+  }
+
+  pager_lock(pager);
+  while (!pager->flusher_stop) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += 1000000000L / FLUSHER_TICKS_PER_SECOND;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&(pager->flusher_wakeup), &(pager->latch),
+                           &deadline);
+
+    uint32_t budget = pages_per_tick;
+    uint32_t page_num;
+    while (!pager->flusher_stop &&
+           (budget > 0 || pager_over_dirty_target(pager)) &&
+           pager_next_dirty_page(pager, &page_num)) {
+      pager_flusher_write(pager, page_num);
+      if (budget > 0) {
+        budget--;
+      }
+    }
+  }
+  pager_unlock(pager);
+  return NULL;
+}
+
+void pager_start_flusher(Pager *pager, DbOptions *options) {
+  if (options->flush_pages_per_second == 0) {
+    return;
+  }
+  pager->flush_pages_per_second = options->flush_pages_per_second;
+  pager->dirty_ratio_target = options->dirty_ratio_target;
+  // Restarting after pager_stop_flusher reuses the buffer
+  if (pager->flush_buffer == NULL &&
+      posix_memalign(&(pager->flush_buffer), PAGE_FRAME_ALIGNMENT,
+                     PAGE_SIZE)) {
+    printf("Unable to allocate flush buffer\n");
+    exit(EXIT_FAILURE);
+  }
+  pager->flusher_stop = false;
+  if (pthread_create(&(pager->flusher), NULL, pager_flusher_main, pager)) {
+    printf("Unable to start background writer, pages flush on close\n");
+    return;
+  }
+  pager->flusher_running = true;
+}
+
+void pager_stop_flusher(Pager *pager) {
+  if (!pager->flusher_running) {
+    return;
+  }
+  pager_lock(pager);
+  pager->flusher_stop = true;
+  pthread_cond_signal(&(pager->flusher_wakeup));
+  pager_unlock(pager);
+  pthread_join(pager->flusher, NULL);
+  pager->flusher_running = false;
+}
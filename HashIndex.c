@@ -0,0 +1,190 @@
+#include "Database.h"
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+AdaptiveHashIndex *adaptive_hash_create(uint32_t max_bytes) {
+  // Round the capacity down to a power of two that fits the memory cap
+  uint32_t capacity = 1;
+  while ((uint64_t)capacity * 2 * sizeof(AdaptiveHashEntry) <= max_bytes) {
+    capacity *= 2;
+  }
+  if (capacity < ADAPTIVE_HASH_PROBE_WINDOW) {
+    return NULL;
+  }
+  AdaptiveHashIndex *index = calloc(1, sizeof(AdaptiveHashIndex));
+  index->entries = calloc(capacity, sizeof(AdaptiveHashEntry));
+  index->capacity = capacity;
+  return index;
+}
+
+void adaptive_hash_free(AdaptiveHashIndex *index) {
+  if (index == NULL) {
+    return;
+  }
+  free(index->entries);
+  free(index);
+}
+
+void adaptive_hash_clear(AdaptiveHashIndex *index) {
+  if (index == NULL) {
+    return;
+  }
+  memset(index->entries, 0, index->capacity * sizeof(AdaptiveHashEntry));
+  index->num_entries = 0;
+}
+
+static uint32_t adaptive_hash_slot(AdaptiveHashIndex *index, uint64_t key) {
+  // Take the high bits so both halves of a composite key spread the slots
+  return (uint32_t)((key * 0x9E3779B97F4A7C15ull) >> 32) &
+         (index->capacity - 1);
+}
+
+static AdaptiveHashEntry *adaptive_hash_probe(AdaptiveHashIndex *index,
+                                              uint64_t key) {
+  uint32_t slot = adaptive_hash_slot(index, key);
+  for (uint32_t i = 0; i < ADAPTIVE_HASH_PROBE_WINDOW; i++) {
+    AdaptiveHashEntry *entry =
+        &(index->entries[(slot + i) & (index->capacity - 1)]);
+    if (entry->used && entry->key == key) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+static void adaptive_hash_drop(AdaptiveHashIndex *index,
+                               AdaptiveHashEntry *entry) {
+  entry->used = false;
+  index->num_entries--;
+}
+
+/*
+Checks the cached position against the leaf. If the key moved inside the
+same leaf the entry is fixed up, if it left the leaf the entry is dropped.
+*/
+static bool adaptive_hash_validate(Table *table, AdaptiveHashEntry *entry) {
+  AdaptiveHashIndex *index = table->hash_index;
+  if (entry->page_num >= table->pager->num_of_pages) {
+    adaptive_hash_drop(index, entry);
+    index->invalidations++;
+    return false;
+  }
+  void *node = get_page(table->pager, entry->page_num);
+  if (get_node_type(node) != NODE_LEAF) {
+    adaptive_hash_drop(index, entry);
+    index->invalidations++;
+    return false;
+  }
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  if (entry->cell_num < num_cells &&
+      leaf_node_key(node, entry->cell_num) == entry->key) {
+    return true;
+  }
+  if (num_cells > 0 && entry->key >= leaf_node_key(node, 0) &&
+      entry->key <= leaf_node_key(node, num_cells - 1)) {
+    Cursor *cursor = leaf_node_find(table, entry->page_num, entry->key);
+    bool found = cursor->cell_num < num_cells &&
+                 leaf_node_key(node, cursor->cell_num) == entry->key;
+    entry->cell_num = cursor->cell_num;
+    free(cursor);
+    if (found) {
+      index->fixups++;
+      return true;
+    }
+  }
+  adaptive_hash_drop(index, entry);
+  index->invalidations++;
+  return false;
+}
+
+Cursor *adaptive_hash_lookup(Table *table, uint64_t key) {
+  AdaptiveHashIndex *index = table->hash_index;
+  if (index == NULL) {
+    return NULL;
+  }
+  AdaptiveHashEntry *entry = adaptive_hash_probe(index, key);
+  if (entry == NULL || entry->page_num == INVALID_PAGE_NUM ||
+      !adaptive_hash_validate(table, entry)) {
+    return NULL;
+  }
+  entry->lookups++;
+  index->lookups++;
+  index->hits++;
+  Cursor *cursor = calloc(1, sizeof(Cursor));
+  cursor->table = table;
+  cursor->page_num = entry->page_num;
+  cursor->cell_num = entry->cell_num;
+  return cursor;
+}
+
+/*
+Called after a full descent. Only keys that were actually found count as
+lookups, probes for missing keys (inserts) are counted as misses and never
+build entries.
+*/
+void adaptive_hash_record(Table *table, uint64_t key, Cursor *cursor) {
+  AdaptiveHashIndex *index = table->hash_index;
+  if (index == NULL) {
+    return;
+  }
+  void *node = get_page(table->pager, cursor->page_num);
+  if (cursor->cell_num >= *leaf_node_num_cells(node) ||
+      leaf_node_key(node, cursor->cell_num) != key) {
+    index->misses++;
+    return;
+  }
+  index->lookups++;
+
+  AdaptiveHashEntry *entry = adaptive_hash_probe(index, key);
+  if (entry == NULL) {
+    // Take a free slot in the window, or evict the coldest entry
+    uint32_t slot = adaptive_hash_slot(index, key);
+    for (uint32_t i = 0; i < ADAPTIVE_HASH_PROBE_WINDOW; i++) {
+      AdaptiveHashEntry *candidate =
+          &(index->entries[(slot + i) & (index->capacity - 1)]);
+      if (!candidate->used) {
+        entry = candidate;
+        break;
+      }
+      if (entry == NULL || candidate->lookups < entry->lookups) {
+        entry = candidate;
+      }
+    }
+    if (entry->used) {
+      index->evictions++;
+    } else {
+      index->num_entries++;
+    }
+    entry->used = true;
+    entry->key = key;
+    entry->page_num = INVALID_PAGE_NUM;
+    entry->lookups = 0;
+  }
+
+  entry->lookups++;
+  if (entry->lookups >= ADAPTIVE_HASH_BUILD_THRESHOLD) {
+    entry->page_num = cursor->page_num;
+    entry->cell_num = cursor->cell_num;
+  }
+}
+
+void adaptive_hash_print_stats(AdaptiveHashIndex *index) {
+  if (index == NULL) {
+    printf("Adaptive hash index disabled.\n");
+    return;
+  }
+  double hit_rate =
+      index->lookups ? 100.0 * index->hits / index->lookups : 0.0;
+  printf("Adaptive hash index: %d/%d entries (%zu bytes)\n",
+         index->num_entries, index->capacity,
+         index->capacity * sizeof(AdaptiveHashEntry));
+  printf("lookups %" PRIu64 ", hits %" PRIu64 " (%.1f%%), misses %" PRIu64
+         ", fixups %" PRIu64 ", invalidations %" PRIu64 ", evictions %" PRIu64
+         "\n",
+         index->lookups, index->hits, hit_rate, index->misses, index->fixups,
+         index->invalidations, index->evictions);
+}
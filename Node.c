@@ -1,5 +1,6 @@
 #include "Database.h"
 #include <errno.h>
+#include <endian.h>
 #include <fcntl.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -9,6 +10,35 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+/*
+Key encoding
+*/
+
+uint64_t key_decode(const void *source) {
+  if (KEY_SIZE == sizeof(uint32_t)) {
+    uint32_t key;
+    memcpy(&key, source, sizeof(key));
+    return be32toh(key);
+  }
+  uint64_t key;
+  memcpy(&key, source, sizeof(key));
+  return be64toh(key);
+}
+
+void key_encode(void *destination, uint64_t key) {
+  if (KEY_SIZE == sizeof(uint32_t)) {
+    uint32_t encoded = htobe32((uint32_t)key);
+    memcpy(destination, &encoded, sizeof(encoded));
+    return;
+  }
+  uint64_t encoded = htobe64(key);
+  memcpy(destination, &encoded, sizeof(encoded));
+}
+
+uint64_t max_key() {
+  return KEY_SIZE == sizeof(uint32_t) ? UINT32_MAX : UINT64_MAX;
+}
+
 /*
 Leaf node fields
 */
@@ -18,11 +48,20 @@ uint32_t *leaf_node_num_cells(void *node) {
 }
 
 void *leaf_node_cell(void *node, uint32_t cell_num) {
-  return node + LEAF_NODE_NUM_CELLS_OFFSET + LEAF_NODE_CELL_SIZE * cell_num;
+  if (is_leaf_node_compressed(node)) {
+    uint16_t slots_offset =
+        *(uint16_t *)(node + COMPRESSED_LEAF_SLOTS_OFFSET_OFFSET);
+    return node + slots_offset + COMPRESSED_LEAF_SLOT_SIZE * cell_num;
+  }
+  return node + LEAF_NODE_HEADER_SIZE + LEAF_NODE_CELL_SIZE * cell_num;
+}
+
+uint64_t leaf_node_key(void *node, uint32_t cell_num) {
+  return key_decode(leaf_node_cell(node, cell_num));
 }
 
-uint32_t *leaf_node_key(void *node, uint32_t cell_num) {
-  return leaf_node_cell(node, cell_num);
+void set_leaf_node_key(void *node, uint32_t cell_num, uint64_t key) {
+  key_encode(leaf_node_cell(node, cell_num), key);
 }
 
 void *leaf_node_value(void *node, uint32_t cell_num) {
@@ -34,6 +73,7 @@ void *initialize_leaf_node(void *node) {
   set_node_root(node, false);
   set_node_type(node, NODE_LEAF);
   *leaf_node_next_leaf(node) = 0;
+  *leaf_node_flags(node) = 0;
 }
 
 void *initialize_internal_node(void *node) {
@@ -47,8 +87,14 @@ uint32_t *leaf_node_next_leaf(void *node) {
   return node + LEAF_NODE_NEXT_LEAF_OFFSET;
 }
 
-void leaf_node_insert(Cursor *cursor, uint32_t key, Row *value) {
-  void *node = get_page(cursor->table->pager, cursor->page_num);
+uint8_t *leaf_node_flags(void *node) { return node + LEAF_NODE_FLAGS_OFFSET; }
+
+void leaf_node_insert(Cursor *cursor, uint64_t key, Row *value) {
+  void *node = get_page_for_write(cursor->table->pager, cursor->page_num);
+  if (is_leaf_node_compressed(node)) {
+    compressed_leaf_insert(cursor, key, value);
+    return;
+  }
   uint32_t num_cells = *leaf_node_num_cells(node);
   if (num_cells >= LEAF_NODE_MAX_CELLS) {
     leaf_node_split_and_insert(cursor, key, value);
@@ -64,10 +110,28 @@ void leaf_node_insert(Cursor *cursor, uint32_t key, Row *value) {
   }
 
   (*(leaf_node_num_cells(node)))++;
-  (*(leaf_node_key(node, cursor->cell_num))) = key;
+  set_leaf_node_key(node, cursor->cell_num, key);
   serialize_row(value, leaf_node_value(node, cursor->cell_num));
 }
 
+/*
+Overwrites only the given columns of the row under the cursor
+*/
+void leaf_node_update(Cursor *cursor, Row *value, uint32_t columns) {
+  void *node = get_page_for_write(cursor->table->pager, cursor->page_num);
+  if (is_leaf_node_compressed(node)) {
+    compressed_leaf_update(cursor, value, columns);
+    return;
+  }
+  void *destination = leaf_node_value(node, cursor->cell_num);
+  if (columns & UPDATE_USERNAME) {
+    memcpy(destination + USERNAME_OFFSET, value->username, USERNAME_SIZE);
+  }
+  if (columns & UPDATE_EMAIL) {
+    memcpy(destination + EMAIL_OFFSET, value->email, EMAIL_SIZE);
+  }
+}
+
 uint32_t *internal_node_num_keys(void *node) {
   return node + INTERNAL_NODE_NUM_KEYS_OFFSET;
 }
@@ -103,8 +167,15 @@ uint32_t *internal_node_child(void *node, uint32_t child_num) {
   }
 }
 
-uint32_t *internal_node_key(void *node, uint32_t key_num) {
-  return internal_node_cell(node, key_num) + INTERNAL_NODE_CHILD_SIZE;
+uint64_t internal_node_key(void *node, uint32_t key_num) {
+  return key_decode((void *)internal_node_cell(node, key_num) +
+                    INTERNAL_NODE_CHILD_SIZE);
+}
+
+void set_internal_node_key(void *node, uint32_t key_num, uint64_t key) {
+  key_encode((void *)internal_node_cell(node, key_num) +
+                 INTERNAL_NODE_CHILD_SIZE,
+             key);
 }
 
 bool is_node_root(void *node) {
@@ -127,23 +198,24 @@ void set_node_type(void *node, NodeType type) {
   (*(uint8_t *)(node + NODE_TYPE_OFFSET)) = val;
 }
 
-void update_internal_node_key(void *node, uint32_t old_key, uint32_t new_key) {
+void update_internal_node_key(void *node, uint64_t old_key, uint64_t new_key) {
   uint32_t old_child_index = internal_node_find_child(node, old_key);
-  *internal_node_key(node, old_child_index) = new_key;
+  set_internal_node_key(node, old_child_index, new_key);
 }
 
 uint32_t *node_parent(void *node) { return node + PARENT_POINTER_OFFSET; }
 
-void leaf_node_split_and_insert(Cursor *cursor, uint32_t key, Row *value) {
-  void *old_node = get_page(cursor->table->pager, cursor->page_num);
-  uint32_t old_max = get_node_max_key(old_node);
+void leaf_node_split_and_insert(Cursor *cursor, uint64_t key, Row *value) {
+  void *old_node =
+      get_page_for_write(cursor->table->pager, cursor->page_num);
+  uint64_t old_max = get_node_max_key(old_node);
   uint32_t new_page_num = get_unused_page_num(cursor->table->pager);
-  void *new_node = get_page(cursor->table->pager, new_page_num);
+  void *new_node = get_page_for_write(cursor->table->pager, new_page_num);
   initialize_leaf_node(new_node);
   *node_parent(new_node) = *node_parent(old_node);
   *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
   *leaf_node_next_leaf(old_node) = new_page_num;
-  for (int32_t i = 0; i <= LEAF_NODE_MAX_CELLS; i++) {
+  for (uint32_t i = LEAF_NODE_MAX_CELLS + 1; i-- > 0;) {
     void *node = NULL;
     if (i >= LEAF_NODE_LEFT_SPLIT_COUNT) {
       node = new_node;
@@ -154,8 +226,8 @@ void leaf_node_split_and_insert(Cursor *cursor, uint32_t key, Row *value) {
     void *dest = leaf_node_cell(node, index);
 
     if (i == cursor->cell_num) {
-      serialize_row(value, dest);
-      *leaf_node_key(value, index) = key;
+      serialize_row(value, leaf_node_value(node, index));
+      set_leaf_node_key(node, index, key);
     } else if (i > cursor->cell_num) {
       memcpy(dest, leaf_node_cell(old_node, i - 1), LEAF_NODE_CELL_SIZE);
     } else {
@@ -166,39 +238,48 @@ void leaf_node_split_and_insert(Cursor *cursor, uint32_t key, Row *value) {
   *(leaf_node_num_cells(old_node)) = LEAF_NODE_LEFT_SPLIT_COUNT;
   *(leaf_node_num_cells(new_node)) = LEAF_NODE_RIGHT_SPLIT_COUNT;
 
+  leaf_node_split_update_parent(cursor->table, old_node, old_max,
+                                new_page_num);
+}
+
+void leaf_node_split_update_parent(Table *table, void *old_node,
+                                   uint64_t old_max, uint32_t new_page_num) {
   if (is_node_root(old_node)) {
-    return create_new_root(cursor->table, new_page_num);
+    return create_new_root(table, new_page_num);
   } else {
     uint32_t parent_page_num = *node_parent(old_node);
-    uint32_t new_max = get_node_max_key(old_node);
-    void *parent = get_page(cursor->table->pager, parent_page_num);
+    uint64_t new_max = get_node_max_key(old_node);
+    void *parent = get_page_for_write(table->pager, parent_page_num);
 
     update_internal_node_key(parent, old_max, new_max);
-    internal_node_insert(cursor->table, parent_page_num, new_page_num);
+    internal_node_insert(table, parent_page_num, new_page_num);
   }
 }
 
-uint32_t get_node_max_key(void *node) {
+uint64_t get_node_max_key(void *node) {
   switch (get_node_type(node)) {
   case NODE_INTERNAL:
-    return *internal_node_key(node, *internal_node_num_keys(node) - 1);
+    return internal_node_key(node, *internal_node_num_keys(node) - 1);
   case NODE_LEAF:
-    return *leaf_node_key(node, *leaf_node_num_cells(node) - 1);
+    return leaf_node_key(node, *leaf_node_num_cells(node) - 1);
   }
 }
 
 void create_new_root(Table *table, uint32_t right_child_page_num) {
-  void *root = get_page(table->pager, table->root_page_num);
-  void *right_child = get_page(table->pager, right_child_page_num);
+  void *root = get_page_for_write(table->pager, table->root_page_num);
+  void *right_child =
+      get_page_for_write(table->pager, right_child_page_num);
   uint32_t left_child_page_num = get_unused_page_num(table->pager);
-  void *left_child = get_page(table->pager, left_child_page_num);
+  void *left_child =
+      get_page_for_write(table->pager, left_child_page_num);
   memcpy(left_child, root, PAGE_SIZE);
+  set_node_root(left_child, false);
   initialize_internal_node(root);
   set_node_root(root, true);
   *internal_node_num_keys(root) = 1;
   *internal_node_child(root, 0) = left_child_page_num;
-  uint32_t left_child_max_key = get_node_max_key(left_child);
-  *internal_node_key(root, 0) = left_child_max_key;
+  uint64_t left_child_max_key = get_node_max_key(left_child);
+  set_internal_node_key(root, 0, left_child_max_key);
   *internal_node_right_child(root) = right_child_page_num;
   *node_parent(left_child) = table->root_page_num;
   *node_parent(right_child) = table->root_page_num;
@@ -206,9 +287,9 @@ void create_new_root(Table *table, uint32_t right_child_page_num) {
 
 void internal_node_insert(Table *table, uint32_t parent_page_num,
                           uint32_t child_page_num) {
-  void *parent = get_page(table->pager, parent_page_num);
+  void *parent = get_page_for_write(table->pager, parent_page_num);
   void *child = get_page(table->pager, child_page_num);
-  uint32_t child_max_key = get_node_max_key(child);
+  uint64_t child_max_key = get_node_max_key(child);
   uint32_t index = internal_node_find_child(parent, child_max_key);
 
   uint32_t original_num_keys = *internal_node_num_keys(parent);
@@ -226,8 +307,8 @@ void internal_node_insert(Table *table, uint32_t parent_page_num,
   *internal_node_num_keys(parent) = original_num_keys + 1;
   if (child_max_key > get_node_max_key(right_child)) {
     *internal_node_child(parent, original_num_keys) = right_child_page_num;
-    *internal_node_key(parent, original_num_keys) =
-        get_node_max_key(right_child);
+    set_internal_node_key(parent, original_num_keys,
+                          get_node_max_key(right_child));
     *internal_node_right_child(parent) = child_page_num;
   } else {
     for (uint32_t i = original_num_keys; i > index; i--) {
@@ -236,7 +317,7 @@ void internal_node_insert(Table *table, uint32_t parent_page_num,
       memcpy(destination, source, INTERNAL_NODE_CELL_SIZE);
     }
     *internal_node_child(parent, index) = child_page_num;
-    *internal_node_key(parent, index) = child_max_key;
+    set_internal_node_key(parent, index, child_max_key);
   }
 }
 
@@ -249,11 +330,11 @@ static inline void indent(uint32_t level) {
 void internal_node_split_and_insert(Table *table, uint32_t parent_page_num,
                                     uint32_t child_page_num) {
   uint32_t old_page_num = parent_page_num;
-  void *old_node = get_page(table->pager, old_page_num);
-  uint32_t old_max = get_node_max_key(old_node);
+  void *old_node = get_page_for_write(table->pager, old_page_num);
+  uint64_t old_max = get_node_max_key(old_node);
 
-  void *child_node = get_page(table->pager, child_page_num);
-  uint32_t child_max = get_node_max_key(child_node);
+  void *child_node = get_page_for_write(table->pager, child_page_num);
+  uint64_t child_max = get_node_max_key(child_node);
 
   uint32_t new_page_num = get_unused_page_num(table->pager);
 
@@ -263,33 +344,33 @@ void internal_node_split_and_insert(Table *table, uint32_t parent_page_num,
   void *new_node;
   if (splitting_root) {
     create_new_root(table, new_page_num);
-    parent = get_page(table->pager, table->root_page_num);
+    parent = get_page_for_write(table->pager, table->root_page_num);
     /*
     If we are splitting the root, we need to update old_node to point
     to the new root's left child, new_page_num will already point to
     the new root's right child
     */
     old_page_num = *internal_node_child(parent, 0);
-    old_node = get_page(table->pager, old_page_num);
+    old_node = get_page_for_write(table->pager, old_page_num);
   } else {
-    parent = get_page(table->pager, *node_parent(old_node));
-    new_node = get_page(table->pager, new_page_num);
+    parent = get_page_for_write(table->pager, *node_parent(old_node));
+    new_node = get_page_for_write(table->pager, new_page_num);
     initialize_internal_node(new_node);
   }
 
   uint32_t *old_num_keys = internal_node_num_keys(old_node);
 
   uint32_t cur_page_num = *internal_node_right_child(old_node);
-  void *cur = get_page(table->pager, cur_page_num);
+  void *cur = get_page_for_write(table->pager, cur_page_num);
 
   internal_node_insert(table, new_page_num, cur_page_num);
   *node_parent(cur) = new_page_num;
   *internal_node_right_child(old_node) = INVALID_PAGE_NUM;
 
-  for (int i = INTERNAL_NODE_MAX_CELLS - 1; i > INTERNAL_NODE_MAX_CELLS / 2;
-       i--) {
+  for (uint32_t i = INTERNAL_NODE_MAX_CELLS - 1;
+       i > INTERNAL_NODE_MAX_CELLS / 2; i--) {
     cur_page_num = *internal_node_child(old_node, i);
-    cur = get_page(table->pager, cur_page_num);
+    cur = get_page_for_write(table->pager, cur_page_num);
 
     internal_node_insert(table, new_page_num, cur_page_num);
     *node_parent(cur) = new_page_num;
@@ -301,7 +382,7 @@ void internal_node_split_and_insert(Table *table, uint32_t parent_page_num,
       *internal_node_child(old_node, *old_num_keys - 1);
   (*old_num_keys)--;
 
-  uint32_t max_after_split = get_node_max_key(old_node);
+  uint64_t max_after_split = get_node_max_key(old_node);
 
   uint32_t destination_page_num =
       child_max < max_after_split ? old_page_num : new_page_num;
@@ -0,0 +1,248 @@
+#define _GNU_SOURCE
+#include "Database.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+  Row row;
+  FILE *run;
+} MergeEntry;
+
+// Negative when a comes before b in the output, ties go by id
+static int sort_compare(const void *a, const void *b, void *context) {
+  Sorter *sorter = (Sorter *)context;
+  const Row *x = (const Row *)a;
+  const Row *y = (const Row *)b;
+  int result = sorter->column == FILTER_COLUMN_USERNAME
+                   ? strcmp(x->username, y->username)
+                   : strcmp(x->email, y->email);
+  if (sorter->descending) {
+    result = -result;
+  }
+  if (result == 0) {
+    result = (x->id > y->id) - (x->id < y->id);
+  }
+  return result;
+}
+
+void sorter_init(Sorter *sorter, FilterColumn column, bool descending,
+                 uint32_t limit, uint32_t memory_bytes) {
+  memset(sorter, 0, sizeof(Sorter));
+  sorter->column = column;
+  sorter->descending = descending;
+  sorter->limit = limit;
+  sorter->max_rows = memory_bytes / sizeof(Row);
+  if (sorter->max_rows < 2) {
+    sorter->max_rows = 2;
+  }
+  sorter->top_n = limit <= sorter->max_rows;
+}
+
+static FILE *sort_run_file() {
+  FILE *run = tmpfile();
+  if (run == NULL) {
+    printf("Error creating sort run file\n");
+    exit(EXIT_FAILURE);
+  }
+  return run;
+}
+
+static void sorter_add_run(Sorter *sorter, FILE *run) {
+  rewind(run);
+  sorter->runs =
+      realloc(sorter->runs, (sorter->num_runs + 1) * sizeof(FILE *));
+  sorter->runs[sorter->num_runs++] = run;
+}
+
+static bool write_run_row(Row *row, void *context) {
+  if (fwrite(row, sizeof(Row), 1, (FILE *)context) != 1) {
+    printf("Error writing sort run\n");
+    exit(EXIT_FAILURE);
+  }
+  return true;
+}
+
+static void sorter_spill(Sorter *sorter) {
+  qsort_r(sorter->rows, sorter->num_rows, sizeof(Row), sort_compare, sorter);
+  FILE *run = sort_run_file();
+  if (fwrite(sorter->rows, sizeof(Row), sorter->num_rows, run) !=
+      sorter->num_rows) {
+    printf("Error writing sort run\n");
+    exit(EXIT_FAILURE);
+  }
+  sorter_add_run(sorter, run);
+  sorter->num_rows = 0;
+}
+
+// The root of the top-n heap is the kept row that would be printed last
+static void top_n_sift_up(Sorter *sorter, uint32_t i) {
+  Row *rows = sorter->rows;
+  while (i > 0) {
+    uint32_t parent = (i - 1) / 2;
+    if (sort_compare(&rows[i], &rows[parent], sorter) <= 0) {
+      return;
+    }
+    Row temp = rows[i];
+    rows[i] = rows[parent];
+    rows[parent] = temp;
+    i = parent;
+  }
+}
+
+static void top_n_sift_down(Sorter *sorter, uint32_t i) {
+  Row *rows = sorter->rows;
+  while (true) {
+    uint32_t largest = i;
+    uint32_t left = 2 * i + 1;
+    uint32_t right = left + 1;
+    if (left < sorter->num_rows &&
+        sort_compare(&rows[left], &rows[largest], sorter) > 0) {
+      largest = left;
+    }
+    if (right < sorter->num_rows &&
+        sort_compare(&rows[right], &rows[largest], sorter) > 0) {
+      largest = right;
+    }
+    if (largest == i) {
+      return;
+    }
+    Row temp = rows[i];
+    rows[i] = rows[largest];
+    rows[largest] = temp;
+    i = largest;
+  }
+}
+
+bool sorter_add(Row *row, void *context) {
+  Sorter *sorter = (Sorter *)context;
+  uint32_t max_rows = sorter->max_rows;
+  if (sorter->top_n) {
+    if (sorter->limit == 0) {
+      return false;
+    }
+    if (sorter->num_rows == sorter->limit) {
+      if (sort_compare(row, &(sorter->rows[0]), sorter) < 0) {
+        sorter->rows[0] = *row;
+        top_n_sift_down(sorter, 0);
+      }
+      return true;
+    }
+    max_rows = sorter->limit;
+  } else if (sorter->num_rows == max_rows) {
+    sorter_spill(sorter);
+  }
+
+  if (sorter->num_rows == sorter->capacity) {
+    // Grow towards the budget so small results stay small
+    uint32_t capacity = sorter->capacity ? sorter->capacity * 2 : 64;
+    if (capacity > max_rows) {
+      capacity = max_rows;
+    }
+    sorter->rows = realloc(sorter->rows, capacity * sizeof(Row));
+    sorter->capacity = capacity;
+  }
+  sorter->rows[sorter->num_rows++] = *row;
+  if (sorter->top_n) {
+    top_n_sift_up(sorter, sorter->num_rows - 1);
+  }
+  return true;
+}
+
+static void merge_sift_down(Sorter *sorter, MergeEntry *heap, uint32_t size,
+                            uint32_t i) {
+  while (true) {
+    uint32_t smallest = i;
+    uint32_t left = 2 * i + 1;
+    uint32_t right = left + 1;
+    if (left < size &&
+        sort_compare(&heap[left].row, &heap[smallest].row, sorter) < 0) {
+      smallest = left;
+    }
+    if (right < size &&
+        sort_compare(&heap[right].row, &heap[smallest].row, sorter) < 0) {
+      smallest = right;
+    }
+    if (smallest == i) {
+      return;
+    }
+    MergeEntry temp = heap[i];
+    heap[i] = heap[smallest];
+    heap[smallest] = temp;
+    i = smallest;
+  }
+}
+
+/*
+Merges sorted runs into the callback, at most limit rows, and closes them.
+Only one row per run is held in memory at a time.
+*/
+static void sorter_merge(Sorter *sorter, FILE **runs, uint32_t num_runs,
+                         RowCallback callback, void *context) {
+  MergeEntry *heap = malloc(num_runs * sizeof(MergeEntry));
+  uint32_t size = 0;
+  for (uint32_t i = 0; i < num_runs; i++) {
+    if (fread(&(heap[size].row), sizeof(Row), 1, runs[i]) == 1) {
+      heap[size++].run = runs[i];
+    }
+  }
+  for (uint32_t i = size / 2; i-- > 0;) {
+    merge_sift_down(sorter, heap, size, i);
+  }
+
+  for (uint32_t emitted = 0; size > 0 && emitted < sorter->limit; emitted++) {
+    if (!callback(&(heap[0].row), context)) {
+      break;
+    }
+    if (fread(&(heap[0].row), sizeof(Row), 1, heap[0].run) != 1) {
+      heap[0] = heap[--size];
+    }
+    merge_sift_down(sorter, heap, size, 0);
+  }
+
+  free(heap);
+  for (uint32_t i = 0; i < num_runs; i++) {
+    fclose(runs[i]);
+  }
+}
+
+/*
+Hands the rows to the callback in sorted order, up to the limit, and frees
+everything the sorter holds
+*/
+void sorter_finish(Sorter *sorter, RowCallback callback, void *context) {
+  if (sorter->num_runs == 0) {
+    if (sorter->num_rows > 0) {
+      qsort_r(sorter->rows, sorter->num_rows, sizeof(Row), sort_compare,
+              sorter);
+    }
+    for (uint32_t i = 0; i < sorter->num_rows && i < sorter->limit; i++) {
+      if (!callback(&(sorter->rows[i]), context)) {
+        break;
+      }
+    }
+  } else {
+    if (sorter->num_rows > 0) {
+      sorter_spill(sorter);
+    }
+    free(sorter->rows);
+    sorter->rows = NULL;
+
+    // Earlier passes merge the oldest runs into new ones at the back
+    while (sorter->num_runs > SORT_MERGE_FAN_IN) {
+      FILE *run = sort_run_file();
+      sorter_merge(sorter, sorter->runs, SORT_MERGE_FAN_IN, write_run_row,
+                   run);
+      sorter->num_runs -= SORT_MERGE_FAN_IN;
+      memmove(sorter->runs, sorter->runs + SORT_MERGE_FAN_IN,
+              sorter->num_runs * sizeof(FILE *));
+      sorter_add_run(sorter, run);
+    }
+    sorter_merge(sorter, sorter->runs, sorter->num_runs, callback, context);
+  }
+  free(sorter->rows);
+  free(sorter->runs);
+  memset(sorter, 0, sizeof(Sorter));
+}
@@ -0,0 +1,337 @@
+#include "Database.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <libgen.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef struct {
+  int file_descriptor;
+  uint32_t fill_percent;
+  bool compressed;
+  uint32_t rows_per_leaf; // uncompressed leaves only
+  uint32_t known_fit;     // compressed leaves: leading rows known to fit
+  uint32_t next_check;    // and the buffer size to try encoding next
+  uint32_t num_pages;     // pages used so far, header included
+  uint64_t num_rows;
+  Row *rows; // rows waiting for the next leaf
+  uint32_t num_buffered;
+  uint32_t rows_capacity;
+  void *page;         // scratch node
+  void *pending_leaf; // written once the leaf after it is known
+  uint32_t pending_page_num;
+  // Page number and max key of each node on the level being built
+  uint32_t *page_nums;
+  uint64_t *max_keys;
+  uint32_t num_nodes;
+  uint32_t nodes_capacity;
+} VacuumBuilder;
+
+static void vacuum_write(VacuumBuilder *builder, void *source, size_t size,
+                         off_t offset) {
+  if (pwrite(builder->file_descriptor, source, size, offset) != (ssize_t)size) {
+    printf("Error writing vacuum file\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void vacuum_write_page(VacuumBuilder *builder, void *page,
+                              uint32_t page_num) {
+  vacuum_write(builder, page, PAGE_SIZE, (off_t)page_num * PAGE_SIZE);
+}
+
+// Children are written before their parent exists, so it is patched in
+static void vacuum_set_parent(VacuumBuilder *builder, uint32_t page_num,
+                              uint32_t parent_page_num) {
+  vacuum_write(builder, &parent_page_num, PARENT_POINTER_SIZE,
+               (off_t)page_num * PAGE_SIZE + PARENT_POINTER_OFFSET);
+}
+
+static void vacuum_add_node(VacuumBuilder *builder, uint32_t page_num,
+                            uint64_t max_key) {
+  if (builder->num_nodes == builder->nodes_capacity) {
+    builder->nodes_capacity =
+        builder->nodes_capacity ? builder->nodes_capacity * 2 : 64;
+    builder->page_nums = realloc(builder->page_nums,
+                                 builder->nodes_capacity * sizeof(uint32_t));
+    builder->max_keys = realloc(builder->max_keys,
+                                builder->nodes_capacity * sizeof(uint64_t));
+  }
+  builder->page_nums[builder->num_nodes] = page_num;
+  builder->max_keys[builder->num_nodes] = max_key;
+  builder->num_nodes++;
+}
+
+/*
+Turns the first num_rows buffered rows into the next leaf and writes out
+the previous one, now that its next leaf is known
+*/
+static void vacuum_emit_leaf(VacuumBuilder *builder, uint32_t num_rows) {
+  uint32_t page_num = builder->num_pages++;
+  void *leaf = builder->pending_leaf;
+  if (builder->pending_page_num != 0) {
+    *leaf_node_next_leaf(leaf) = page_num;
+    vacuum_write_page(builder, leaf, builder->pending_page_num);
+  }
+
+  memset(leaf, 0, PAGE_SIZE);
+  Row *rows = builder->rows;
+  if (builder->compressed) {
+    initialize_compressed_leaf_node(leaf);
+    compressed_leaf_encode(leaf, rows, num_rows);
+  } else {
+    initialize_leaf_node(leaf);
+    *leaf_node_num_cells(leaf) = num_rows;
+    for (uint32_t i = 0; i < num_rows; i++) {
+      set_leaf_node_key(leaf, i, rows[i].id);
+      serialize_row(&rows[i], leaf_node_value(leaf, i));
+    }
+  }
+  builder->pending_page_num = page_num;
+  vacuum_add_node(builder, page_num, num_rows ? rows[num_rows - 1].id : 0);
+
+  builder->num_buffered -= num_rows;
+  if (builder->num_buffered > 0) {
+    memmove(rows, rows + num_rows, builder->num_buffered * sizeof(Row));
+  }
+}
+
+/*
+Largest number of leading buffered rows that fit in one compressed leaf,
+given that the first known_fit of them do. Binary search, so a leaf costs a
+few encodes rather than one per row.
+*/
+static uint32_t vacuum_rows_that_fit(VacuumBuilder *builder,
+                                     uint32_t known_fit) {
+  uint32_t high = builder->num_buffered;
+  if (compressed_leaf_encode(builder->page, builder->rows, high)) {
+    return high;
+  }
+  uint32_t low = known_fit ? known_fit : 1;
+  while (high - low > 1) {
+    uint32_t middle = low + (high - low) / 2;
+    if (compressed_leaf_encode(builder->page, builder->rows, middle)) {
+      low = middle;
+    } else {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+static bool vacuum_add_row(Row *row, void *context) {
+  VacuumBuilder *builder = (VacuumBuilder *)context;
+  if (builder->num_buffered == builder->rows_capacity) {
+    builder->rows_capacity =
+        builder->rows_capacity ? builder->rows_capacity * 2 : 64;
+    builder->rows =
+        realloc(builder->rows, builder->rows_capacity * sizeof(Row));
+  }
+  builder->rows[builder->num_buffered++] = *row;
+  builder->num_rows++;
+
+  if (!builder->compressed) {
+    if (builder->num_buffered == builder->rows_per_leaf) {
+      vacuum_emit_leaf(builder, builder->num_buffered);
+    }
+  } else if (builder->num_buffered >= builder->next_check) {
+    // Encoding the buffer is linear, so check at geometrically spaced counts
+    if (compressed_leaf_encode(builder->page, builder->rows,
+                               builder->num_buffered)) {
+      builder->known_fit = builder->num_buffered;
+      builder->next_check =
+          builder->num_buffered + builder->num_buffered / 4 + 1;
+    } else {
+      // The page is full: keep the fill factor's share of it, carry the rest
+      uint32_t fit = vacuum_rows_that_fit(builder, builder->known_fit);
+      uint32_t num_rows = fit * builder->fill_percent / 100;
+      vacuum_emit_leaf(builder, num_rows ? num_rows : 1);
+      builder->known_fit = 0;
+      builder->next_check = builder->num_buffered + 1;
+    }
+  }
+  return true;
+}
+
+static void vacuum_finish_leaves(VacuumBuilder *builder) {
+  while (builder->num_buffered > 0) {
+    uint32_t num_rows = builder->num_buffered;
+    if (builder->compressed) {
+      num_rows = vacuum_rows_that_fit(builder, 0);
+    }
+    vacuum_emit_leaf(builder, num_rows);
+  }
+  if (builder->num_nodes == 0) {
+    // Empty table, the root is an empty leaf
+    vacuum_emit_leaf(builder, 0);
+  }
+  void *leaf = builder->pending_leaf;
+  *leaf_node_next_leaf(leaf) = 0;
+  set_node_root(leaf, builder->num_nodes == 1);
+  vacuum_write_page(builder, leaf, builder->pending_page_num);
+}
+
+/*
+Builds the internal levels bottom up, each level on the pages right after
+the one below it, and returns the root page
+*/
+static uint32_t vacuum_build_internal_levels(VacuumBuilder *builder) {
+  uint32_t fan_out =
+      (INTERNAL_NODE_MAX_CELLS + 1) * builder->fill_percent / 100;
+  if (fan_out < 2) {
+    fan_out = 2;
+  }
+  void *node = builder->page;
+  while (builder->num_nodes > 1) {
+    uint32_t *children = builder->page_nums;
+    uint64_t *child_keys = builder->max_keys;
+    uint32_t num_children = builder->num_nodes;
+    builder->page_nums = NULL;
+    builder->max_keys = NULL;
+    builder->num_nodes = 0;
+    builder->nodes_capacity = 0;
+
+    // Spread the children evenly so no node ends up nearly empty
+    uint32_t num_parents = (num_children + fan_out - 1) / fan_out;
+    for (uint32_t p = 0; p < num_parents; p++) {
+      uint32_t first = (uint64_t)p * num_children / num_parents;
+      uint32_t last = (uint64_t)(p + 1) * num_children / num_parents;
+      uint32_t page_num = builder->num_pages++;
+
+      memset(node, 0, PAGE_SIZE);
+      set_node_type(node, NODE_INTERNAL);
+      set_node_root(node, num_parents == 1);
+      *internal_node_num_keys(node) = last - first - 1;
+      for (uint32_t i = first; i < last - 1; i++) {
+        *internal_node_cell(node, i - first) = children[i];
+        set_internal_node_key(node, i - first, child_keys[i]);
+      }
+      *internal_node_right_child(node) = children[last - 1];
+      vacuum_write_page(builder, node, page_num);
+
+      for (uint32_t i = first; i < last; i++) {
+        vacuum_set_parent(builder, children[i], page_num);
+      }
+      vacuum_add_node(builder, page_num, child_keys[last - 1]);
+    }
+    free(children);
+    free(child_keys);
+  }
+  return builder->page_nums[0];
+}
+
+static void vacuum_builder_free(VacuumBuilder *builder) {
+  free(builder->page);
+  free(builder->pending_leaf);
+  free(builder->rows);
+  free(builder->page_nums);
+  free(builder->max_keys);
+}
+
+static void sync_directory_of(const char *filename) {
+  char *copy = strdup(filename);
+  int fd = open(dirname(copy), O_RDONLY);
+  if (fd != -1) {
+    fsync(fd);
+    close(fd);
+  }
+  free(copy);
+}
+
+/*
+Rewrites the table into a new file and swaps it in. The old file is left
+untouched until the rename, so a failed vacuum loses nothing.
+*/
+bool db_vacuum(Table *table, uint32_t fill_percent) {
+  Pager *pager = table->pager;
+  if (pager->snapshots != NULL) {
+    printf("Cannot vacuum while snapshots are open.\n");
+    return false;
+  }
+  // With the background writer stopped nothing else touches the pager
+  pager_stop_flusher(pager);
+  DbOptions options = {PAGE_SIZE,
+                       pager->header.flags,
+                       KEY_SIZE,
+                       0,
+                       pager->direct_io,
+                       pager->flush_pages_per_second,
+                       pager->dirty_ratio_target,
+                       0};
+
+  char *filename = strdup(pager->filename);
+  char *vacuum_filename =
+      malloc(strlen(filename) + strlen(VACUUM_FILE_SUFFIX) + 1);
+  sprintf(vacuum_filename, "%s%s", filename, VACUUM_FILE_SUFFIX);
+  int fd = open(vacuum_filename, O_RDWR | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+  if (fd == -1) {
+    printf("Unable to create %s\n", vacuum_filename);
+    free(vacuum_filename);
+    free(filename);
+    pager_start_flusher(pager, &options);
+    return false;
+  }
+
+  VacuumBuilder builder;
+  memset(&builder, 0, sizeof(VacuumBuilder));
+  builder.file_descriptor = fd;
+  builder.fill_percent = fill_percent;
+  builder.compressed = pager->header.flags & DB_FLAG_COMPRESSED_LEAVES;
+  builder.rows_per_leaf = LEAF_NODE_MAX_CELLS * fill_percent / 100;
+  if (builder.rows_per_leaf == 0) {
+    builder.rows_per_leaf = 1;
+  }
+  builder.num_pages = DB_HEADER_PAGE_NUM + 1;
+  builder.page = calloc(1, PAGE_SIZE);
+  builder.pending_leaf = calloc(1, PAGE_SIZE);
+  if (builder.compressed) {
+    initialize_compressed_leaf_node(builder.page);
+  }
+
+  StringFilter all_rows;
+  memset(&all_rows, 0, sizeof(StringFilter));
+  all_rows.kind = FILTER_NONE;
+  table_scan(table, &all_rows, vacuum_add_row, &builder);
+  vacuum_finish_leaves(&builder);
+  uint32_t root_page_num = vacuum_build_internal_levels(&builder);
+
+  DbHeader header = pager->header;
+  header.root_page_num = root_page_num;
+  header.num_pages = builder.num_pages;
+  header.freelist_head = 0;
+  memset(builder.page, 0, PAGE_SIZE);
+  memcpy(builder.page, &header, sizeof(DbHeader));
+  vacuum_write_page(&builder, builder.page, DB_HEADER_PAGE_NUM);
+  bool synced = fsync(fd) == 0;
+  if (close(fd) == -1 || !synced || rename(vacuum_filename, filename) == -1) {
+    printf("Unable to replace the db file, it is unchanged\n");
+    unlink(vacuum_filename);
+    pager_start_flusher(pager, &options);
+    vacuum_builder_free(&builder);
+    free(vacuum_filename);
+    free(filename);
+    return false;
+  }
+  sync_directory_of(filename);
+
+  // Everything cached belongs to the replaced file and is dropped unwritten
+  uint32_t old_num_pages = pager->num_of_pages;
+  pager_free(pager);
+  table->pager = pager_open(filename, &options);
+  table->root_page_num = table->pager->header.root_page_num;
+  adaptive_hash_clear(table->hash_index);
+  pager_start_flusher(table->pager, &options);
+  printf("Vacuum wrote %" PRIu64 " rows into %d pages (was %d).\n",
+         builder.num_rows, builder.num_pages, old_num_pages);
+
+  vacuum_builder_free(&builder);
+  free(vacuum_filename);
+  free(filename);
+  return true;
+}